@@ -103,12 +103,15 @@ int main(int argc, char* argv[]) {
   pthread_t notif_thread;
   pthread_create(&notif_thread, NULL, notification_handler, &data);
 
+  Reader input;
+  reader_init(&input, STDIN_FILENO);
+
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
   unsigned int delay_ms;
   size_t num;
 
   while (1) {
-    switch (get_next(STDIN_FILENO)) {
+    switch (get_next(&input)) {
       case CMD_DISCONNECT:
         kvs_disconnect();
 
@@ -120,7 +123,7 @@ int main(int argc, char* argv[]) {
         return 0;
 
       case CMD_SUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(&input, keys, 1, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
@@ -130,7 +133,7 @@ int main(int argc, char* argv[]) {
         break;
 
       case CMD_UNSUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(&input, keys, 1, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
@@ -140,7 +143,7 @@ int main(int argc, char* argv[]) {
         break;
 
       case CMD_DELAY:
-        if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
+        if (parse_delay(&input, &delay_ms) == -1) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
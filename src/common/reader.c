@@ -0,0 +1,109 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void reader_init(Reader *reader, int fd) {
+  reader->fd = fd;
+  reader->pos = 0;
+  reader->len = 0;
+  memset(reader->buffer + READER_BUFFER_SIZE, 0, READER_PADDING);
+}
+
+int reader_fill(Reader *reader) {
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(reader->fd, reader->buffer, READER_BUFFER_SIZE);
+  } while (bytes_read < 0 && errno == EINTR);
+  reader->pos = 0;
+  reader->len = bytes_read > 0 ? (size_t)bytes_read : 0;
+  return reader->len > 0;
+}
+
+size_t reader_read(Reader *reader, char *buffer, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    if (reader->pos == reader->len && !reader_fill(reader)) {
+      break;
+    }
+    size_t count = reader->len - reader->pos;
+    if (count > size - done) {
+      count = size - done;
+    }
+    memcpy(buffer + done, reader->buffer + reader->pos, count);
+    reader->pos += count;
+    done += count;
+  }
+  return done;
+}
+
+void reader_skip_line(Reader *reader) {
+  while (reader->pos < reader->len || reader_fill(reader)) {
+    char *newline = memchr(reader->buffer + reader->pos, '\n', reader->len - reader->pos);
+    if (newline != NULL) {
+      reader->pos = (size_t)(newline - reader->buffer) + 1;
+      return;
+    }
+    reader->pos = reader->len;
+  }
+}
+
+// Finds the first separator of a token in the first len bytes of data. Up to
+// 15 bytes past them may be loaded, never used.
+// @return Its offset, len if there is none.
+static size_t find_separator(const char *data, size_t len) {
+#ifdef __SSE2__
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i paren = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    __m128i found = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, paren)),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, bracket), _mm_cmpeq_epi8(bytes, space)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(found);
+    if (mask != 0) {
+      size_t offset = i + (size_t)__builtin_ctz(mask);
+      return offset < len ? offset : len;
+    }
+  }
+  return len;
+#else
+  size_t i = 0;
+  while (i < len && data[i] != ',' && data[i] != ')' && data[i] != ']' && data[i] != ' ') {
+    i++;
+  }
+  return i;
+#endif
+}
+
+int reader_token(Reader *reader, char *token, size_t max, char *separator) {
+  size_t count = 0;
+  while (count < max) {
+    if (reader->pos == reader->len && !reader_fill(reader)) {
+      return 1;
+    }
+    const char *data = reader->buffer + reader->pos;
+    size_t window = reader->len - reader->pos;
+    if (window > max - count) {
+      window = max - count;
+    }
+    size_t found = find_separator(data, window);
+    memcpy(token + count, data, found);
+    count += found;
+    if (found < window) {
+      reader->pos += found + 1;
+      *separator = data[found];
+      token[count] = '\0';
+      return 0;
+    }
+    reader->pos += found;
+  }
+  return 1;
+}
@@ -0,0 +1,65 @@
+#ifndef COMMON_READER_H
+#define COMMON_READER_H
+
+#include <stddef.h>
+
+#define READER_BUFFER_SIZE 65536
+#define READER_PADDING 16 // readable bytes past the buffer, for vector loads
+
+// Buffered input for the command parsers. Bytes are read from the file
+// descriptor a buffer at a time, so parsing a job costs a read() per
+// READER_BUFFER_SIZE bytes instead of one per character. A terminal or a
+// pipe gives what it has, so an interactive line is parsed as soon as it
+// arrives.
+typedef struct {
+  int fd;
+  size_t pos;   // next byte of the buffer to hand out
+  size_t len;   // bytes in the buffer
+  char buffer[READER_BUFFER_SIZE + READER_PADDING];
+} Reader;
+
+/// Starts reading a file descriptor.
+/// @param reader Reader to initialize.
+/// @param fd File descriptor to read from, left open.
+void reader_init(Reader *reader, int fd);
+
+/// Refills the buffer once it was consumed.
+/// @param reader Reader.
+/// @return 1 if there are bytes to read, 0 at the end of the input or on error.
+int reader_fill(Reader *reader);
+
+/// Reads a character.
+/// @param reader Reader.
+/// @param ch Where to store the character.
+/// @return 1 on success, 0 at the end of the input or on error.
+static inline int reader_getc(Reader *reader, char *ch) {
+  if (reader->pos == reader->len && !reader_fill(reader)) {
+    return 0;
+  }
+  *ch = reader->buffer[reader->pos++];
+  return 1;
+}
+
+/// Reads up to size bytes, fewer only at the end of the input.
+/// @param reader Reader.
+/// @param buffer Where to store the bytes.
+/// @param size Number of bytes wanted.
+/// @return Number of bytes read.
+size_t reader_read(Reader *reader, char *buffer, size_t size);
+
+/// Reads a token of a command's list, up to the first ',', ')', ']' or ' '.
+/// The separators are found 16 bytes at a time, and the token is copied
+/// straight from the buffer.
+/// @param reader Reader.
+/// @param token Receives the token, null terminated if a separator is found.
+/// @param max Size of token, a token of max characters or more is an error.
+/// @param separator Receives the character that ended the token.
+/// @return 0 if a separator was found, after consuming it, 1 at the end of
+///         the input or after max characters without one.
+int reader_token(Reader *reader, char *token, size_t max, char *separator);
+
+/// Skips the rest of the current line, its newline included.
+/// @param reader Reader.
+void reader_skip_line(Reader *reader);
+
+#endif  // COMMON_READER_H
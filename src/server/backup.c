@@ -0,0 +1,534 @@
+#include "backup.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "encode.h"
+#include "lz.h"
+#include "src/common/io.h"
+
+#define BACKUP_MAGIC "KVSBACK" // with its '\0', 8 bytes
+#define MANIFEST_MAGIC "KVSSEGS"
+#define MAX_MANIFEST_NAMES (MAX_BACKUP_SEGMENTS * (1 + UCHAR_MAX))
+#define WRITE_BUFFER_SIZE 65536
+#define CRC32C_POLY 0x82f63b78 // reversed Castagnoli polynomial
+
+struct BackupWriter {
+  int fd;
+  BackupCompression compression;
+  uint64_t offset;   // file offset of the end of the buffer
+  uint64_t checksum;
+  uint64_t num_entries;
+  uint64_t *index;
+  size_t num_blocks;
+  size_t index_capacity;
+  size_t used;
+  unsigned char data[WRITE_BUFFER_SIZE];
+  size_t block_used;                           // records of the block, compressed only
+  unsigned char block[BACKUP_MAX_BLOCK_SIZE];
+  unsigned char packed[BACKUP_MAX_BLOCK_SIZE];
+};
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][n] = crc;
+  }
+  for (int t = 1; t < 8; t++) {
+    for (int n = 0; n < 256; n++) {
+      uint32_t prev = crc_table[t - 1][n];
+      crc_table[t][n] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+    }
+  }
+}
+
+// CRC32C, eight bytes at a time (slicing by 8).
+static uint32_t crc32c(const unsigned char *p, size_t len) {
+  pthread_once(&crc_once, crc_init);
+  uint32_t crc = 0xffffffff;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word = get_u64(p) ^ crc;
+    crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+          crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+          crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+          crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+  }
+  for (; len > 0; p++, len--) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+  }
+  return ~crc;
+}
+
+static int writer_flush(BackupWriter *w) {
+  w->checksum = fnv1a(w->checksum, w->data, w->used);
+  int result = write_all(w->fd, w->data, w->used);
+  w->used = 0;
+  return result == 1 ? 0 : 1;
+}
+
+static int writer_put(BackupWriter *w, const void *data, size_t len) {
+  if (w->used + len > WRITE_BUFFER_SIZE && writer_flush(w) != 0) {
+    return 1;
+  }
+  memcpy(w->data + w->used, data, len);
+  w->used += len;
+  w->offset += len;
+  return 0;
+}
+
+BackupWriter *backup_writer_open(int fd, BackupCompression compression) {
+  BackupWriter *w = malloc(sizeof(BackupWriter));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fd = fd;
+  w->compression = compression;
+  w->block_used = 0;
+  w->offset = BACKUP_HEADER_SIZE;
+  w->checksum = FNV_OFFSET;
+  w->num_entries = 0;
+  w->index = NULL;
+  w->num_blocks = 0;
+  w->index_capacity = 0;
+  w->used = 0;
+
+  // the header is only known at the end, room is left for it
+  unsigned char header[BACKUP_HEADER_SIZE] = {0};
+  if (write_all(fd, header, sizeof(header)) != 1) {
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+// Adds the current end of the file to the index.
+static int index_block(BackupWriter *w) {
+  if (w->num_blocks == w->index_capacity) {
+    size_t capacity = w->index_capacity == 0 ? 64 : w->index_capacity * 2;
+    uint64_t *index = realloc(w->index, capacity * sizeof(uint64_t));
+    if (index == NULL) {
+      return 1;
+    }
+    w->index = index;
+    w->index_capacity = capacity;
+  }
+  w->index[w->num_blocks++] = w->offset;
+  return 0;
+}
+
+// Compresses and writes the records gathered for a block.
+static int flush_block(BackupWriter *w) {
+  if (w->block_used == 0) {
+    return 0;
+  }
+  size_t packed = lz_compress(w->block, w->block_used, w->packed, sizeof(w->packed));
+  const unsigned char *payload = packed == 0 ? w->block : w->packed;
+  size_t len = packed == 0 ? w->block_used : packed;
+  unsigned char header[BACKUP_BLOCK_HEADER_SIZE];
+  put_u32(header, (uint32_t)len);
+  put_u32(header + 4, (uint32_t)w->block_used);
+  put_u32(header + 8, crc32c(w->block, w->block_used));
+  w->block_used = 0;
+  return index_block(w) || writer_put(w, header, sizeof(header)) || writer_put(w, payload, len);
+}
+
+static int record_put(BackupWriter *w, const void *data, size_t len) {
+  if (w->compression == BACKUP_UNCOMPRESSED) {
+    return writer_put(w, data, len);
+  }
+  memcpy(w->block + w->block_used, data, len);
+  w->block_used += len;
+  return 0;
+}
+
+int backup_writer_put(BackupWriter *w, const char *key, const char *value) {
+  if (w->num_entries % BACKUP_BLOCK_ENTRIES == 0) {
+    int failed = w->compression == BACKUP_UNCOMPRESSED ? index_block(w) : flush_block(w);
+    if (failed) {
+      return 1;
+    }
+  }
+
+  unsigned char lens[2] = {(unsigned char)strlen(key),
+                           value == NULL ? BACKUP_TOMBSTONE : (unsigned char)strlen(value)};
+  w->num_entries++;
+  return record_put(w, lens, 2) || record_put(w, key, lens[0]) ||
+         (value != NULL && record_put(w, value, lens[1]));
+}
+
+int backup_writer_close(BackupWriter *w, const BackupInfo *info, int failed) {
+  if (!failed) {
+    failed = flush_block(w);
+  }
+  uint64_t index_offset = w->offset;
+  for (size_t b = 0; b < w->num_blocks && !failed; b++) {
+    unsigned char offset[8];
+    put_u64(offset, w->index[b]);
+    failed = writer_put(w, offset, sizeof(offset));
+  }
+  if (!failed) {
+    failed = writer_flush(w);
+  }
+
+  if (!failed) {
+    unsigned char header[BACKUP_HEADER_SIZE] = {0};
+    memcpy(header, BACKUP_MAGIC, 8);
+    put_u32(header + 8, BACKUP_FORMAT_VERSION);
+    put_u32(header + 12, BACKUP_BLOCK_ENTRIES);
+    put_u64(header + 16, w->num_entries);
+    put_u64(header + 24, w->num_blocks);
+    put_u64(header + 32, index_offset);
+    put_u64(header + 40, w->checksum);
+    put_u32(header + 48, info->kind);
+    put_u32(header + 52, w->compression);
+    put_u64(header + 56, info->stream);
+    put_u64(header + 64, info->snapshot);
+    put_u64(header + 72, info->base);
+    failed = pwrite(w->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header);
+  }
+
+  free(w->index);
+  free(w);
+  return failed;
+}
+
+int backup_open(BackupFile *file, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open backup %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < BACKUP_HEADER_SIZE) {
+    fprintf(stderr, "Backup %s is too short\n", path);
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map backup %s\n", path);
+    return 1;
+  }
+
+  const unsigned char *p = data;
+  uint64_t num_blocks = get_u64(p + 24);
+  uint64_t index_offset = get_u64(p + 32);
+  const char *error = NULL;
+  if (memcmp(p, BACKUP_MAGIC, 8) != 0) {
+    error = "is not a binary backup";
+  } else if (get_u32(p + 8) != BACKUP_FORMAT_VERSION) {
+    error = "has an unknown format version";
+  } else if (get_u32(p + 12) != BACKUP_BLOCK_ENTRIES || index_offset < BACKUP_HEADER_SIZE ||
+             index_offset > size || num_blocks != (size - index_offset) / 8 ||
+             (size - index_offset) % 8 != 0 ||
+             num_blocks != (get_u64(p + 16) + BACKUP_BLOCK_ENTRIES - 1) / BACKUP_BLOCK_ENTRIES) {
+    error = "has a malformed header";
+  } else if (get_u32(p + 48) > BACKUP_DELTA) {
+    error = "has an unknown kind";
+  } else if (get_u32(p + 52) > BACKUP_LZ) {
+    error = "has an unknown compression";
+  } else if (fnv1a(FNV_OFFSET, p + BACKUP_HEADER_SIZE, size - BACKUP_HEADER_SIZE) !=
+             get_u64(p + 40)) {
+    error = "is corrupted";
+  }
+  if (error != NULL) {
+    fprintf(stderr, "Backup %s %s\n", path, error);
+    munmap(data, size);
+    return 1;
+  }
+
+  // the whole file is read right away, by several threads at once
+  posix_madvise(data, size, POSIX_MADV_WILLNEED);
+  BackupInfo info = {get_u32(p + 48) == BACKUP_DELTA ? BACKUP_DELTA : BACKUP_FULL,
+                     get_u64(p + 56), get_u64(p + 64), get_u64(p + 72)};
+  BackupCompression compression = get_u32(p + 52) == BACKUP_LZ ? BACKUP_LZ : BACKUP_UNCOMPRESSED;
+  *file = (BackupFile){p, size, get_u64(p + 16), num_blocks, p + index_offset, compression, info};
+  return 0;
+}
+
+int backup_reader_init(BackupReader *reader, const BackupFile *file, uint64_t block) {
+  uint64_t first = block * BACKUP_BLOCK_ENTRIES;
+  if (block >= file->num_blocks || first >= file->num_entries) {
+    return 1;
+  }
+  reader->file = file;
+  reader->left = file->num_entries - first;
+  reader->block = block;
+  if (file->compression == BACKUP_UNCOMPRESSED) {
+    // the records of every block follow each other, the reader goes on past
+    // its first block without looking at the index again
+    reader->data = file->data;
+    reader->end = (uint64_t)(file->index - file->data);
+    reader->offset = get_u64(file->index + 8 * block);
+    if (reader->offset < BACKUP_HEADER_SIZE || reader->offset > reader->end) {
+      reader->offset = reader->end; // the first read fails
+    }
+  } else {
+    reader->data = reader->raw;
+    reader->offset = 0;
+    reader->end = 0; // the block is decompressed by the first read
+  }
+  return 0;
+}
+
+// Decompresses the reader's next block and checks it.
+// @return 0 on success, 1 if the block is malformed.
+static int load_block(BackupReader *reader) {
+  const BackupFile *file = reader->file;
+  if (reader->block >= file->num_blocks) {
+    return 1;
+  }
+  uint64_t offset = get_u64(file->index + 8 * reader->block);
+  uint64_t limit = (uint64_t)(file->index - file->data);
+  if (offset < BACKUP_HEADER_SIZE || offset > limit || limit - offset < BACKUP_BLOCK_HEADER_SIZE) {
+    return 1;
+  }
+  const unsigned char *header = file->data + offset;
+  const unsigned char *payload = header + BACKUP_BLOCK_HEADER_SIZE;
+  size_t len = get_u32(header);
+  size_t raw_len = get_u32(header + 4);
+  if (len > limit - offset - BACKUP_BLOCK_HEADER_SIZE || raw_len > BACKUP_MAX_BLOCK_SIZE) {
+    return 1;
+  }
+  if (len == raw_len) {
+    reader->data = payload; // stored as it is
+  } else {
+    if (lz_decompress(payload, len, reader->raw, raw_len) != 0) {
+      return 1;
+    }
+    reader->data = reader->raw;
+  }
+  if (crc32c(reader->data, raw_len) != get_u32(header + 8)) {
+    return 1;
+  }
+  reader->offset = 0;
+  reader->end = raw_len;
+  reader->block++;
+  return 0;
+}
+
+int backup_reader_next(BackupReader *reader, char *key, char *value, int *deleted) {
+  if (reader->left == 0) {
+    return 0;
+  }
+  if (reader->offset == reader->end && reader->file->compression != BACKUP_UNCOMPRESSED &&
+      load_block(reader) != 0) {
+    return -1;
+  }
+  const unsigned char *data = reader->data;
+  uint64_t offset = reader->offset;
+  uint64_t end = reader->end;
+  if (offset >= end || end - offset < 2) {
+    return -1;
+  }
+  size_t key_len = data[offset];
+  size_t value_len = data[offset + 1];
+  *deleted = value_len == BACKUP_TOMBSTONE;
+  if (*deleted) {
+    value_len = 0;
+  }
+  offset += 2;
+  if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE ||
+      end - offset < key_len + value_len) {
+    return -1;
+  }
+  memcpy(key, data + offset, key_len);
+  key[key_len] = '\0';
+  offset += key_len;
+  memcpy(value, data + offset, value_len);
+  value[value_len] = '\0';
+  reader->offset = offset + value_len;
+  reader->left--;
+  return 1;
+}
+
+int backup_read_block(const BackupFile *file, uint64_t block,
+                      char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+  BackupReader reader;
+  if (backup_reader_init(&reader, file, block) != 0) {
+    return -1;
+  }
+  int count = 0;
+  int deleted;
+  while (count < BACKUP_BLOCK_ENTRIES) {
+    int read = backup_reader_next(&reader, keys[count], values[count], &deleted);
+    if (read < 0 || (read == 1 && deleted)) {
+      return -1;
+    }
+    if (read == 0) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+void backup_close(BackupFile *file) {
+  munmap((void *)file->data, file->size);
+}
+
+int backup_manifest_write(int fd, const BackupInfo *info, size_t num_segments,
+                          const char *const *names) {
+  if (num_segments == 0 || num_segments > MAX_BACKUP_SEGMENTS) {
+    return 1;
+  }
+  unsigned char body[MAX_MANIFEST_NAMES];
+  size_t len = 0;
+  for (size_t i = 0; i < num_segments; i++) {
+    size_t name_len = strlen(names[i]);
+    if (name_len == 0 || name_len > UCHAR_MAX) {
+      return 1;
+    }
+    body[len++] = (unsigned char)name_len;
+    memcpy(body + len, names[i], name_len);
+    len += name_len;
+  }
+
+  unsigned char header[BACKUP_MANIFEST_HEADER_SIZE] = {0};
+  memcpy(header, MANIFEST_MAGIC, 8);
+  put_u32(header + 8, BACKUP_FORMAT_VERSION);
+  put_u32(header + 12, (uint32_t)num_segments);
+  put_u64(header + 16, fnv1a(FNV_OFFSET, body, len));
+  put_u32(header + 24, info->kind);
+  put_u64(header + 32, info->stream);
+  put_u64(header + 40, info->snapshot);
+  put_u64(header + 48, info->base);
+  return write_all(fd, header, sizeof(header)) != 1 || write_all(fd, body, len) != 1;
+}
+
+// Opens the segments a manifest lists.
+// @return 0 on success, 1 otherwise.
+static int open_segments(BackupSet *set, const char *path, const unsigned char *header,
+                         const unsigned char *body, size_t len) {
+  size_t num_segments = get_u32(header + 12);
+  const char *error = NULL;
+  if (get_u32(header + 8) != BACKUP_FORMAT_VERSION) {
+    error = "has an unknown format version";
+  } else if (num_segments == 0 || num_segments > MAX_BACKUP_SEGMENTS) {
+    error = "has a malformed header";
+  } else if (get_u32(header + 24) > BACKUP_DELTA) {
+    error = "has an unknown kind";
+  } else if (fnv1a(FNV_OFFSET, body, len) != get_u64(header + 16)) {
+    error = "is corrupted";
+  }
+  if (error != NULL) {
+    fprintf(stderr, "Backup manifest %s %s\n", path, error);
+    return 1;
+  }
+  set->info = (BackupInfo){get_u32(header + 24) == BACKUP_DELTA ? BACKUP_DELTA : BACKUP_FULL,
+                           get_u64(header + 32), get_u64(header + 40), get_u64(header + 48)};
+  set->files = calloc(num_segments, sizeof(BackupFile));
+  if (set->files == NULL) {
+    return 1;
+  }
+
+  // segment names are relative to the manifest's directory
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash == NULL ? 0 : (int)(slash - path + 1);
+  size_t offset = 0;
+  for (size_t i = 0; i < num_segments; i++) {
+    size_t name_len = offset < len ? body[offset] : 0;
+    if (name_len == 0 || len - offset - 1 < name_len) {
+      fprintf(stderr, "Backup manifest %s is malformed\n", path);
+      return 1;
+    }
+    char segment_path[PATH_MAX];
+    snprintf(segment_path, sizeof(segment_path), "%.*s%.*s", dir_len, path, (int)name_len,
+             (const char *)body + offset + 1);
+    offset += 1 + name_len;
+    if (backup_open(&set->files[i], segment_path) != 0) {
+      return 1;
+    }
+    set->num_files++;
+    set->num_blocks += set->files[i].num_blocks;
+
+    const BackupInfo *info = &set->files[i].info;
+    if (info->kind != set->info.kind || info->stream != set->info.stream ||
+        info->snapshot != set->info.snapshot || info->base != set->info.base) {
+      fprintf(stderr, "Segment %s does not belong to %s\n", segment_path, path);
+      return 1;
+    }
+  }
+  if (offset != len) {
+    fprintf(stderr, "Backup manifest %s is malformed\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+int backup_set_open(BackupSet *set, const char *path) {
+  *set = (BackupSet){NULL, 0, 0, {BACKUP_FULL, 0, 0, 0}};
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open backup %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  unsigned char header[BACKUP_MANIFEST_HEADER_SIZE];
+  int manifest = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header) &&
+                 read_all(fd, header, sizeof(header), NULL) == 1 &&
+                 memcmp(header, MANIFEST_MAGIC, 8) == 0;
+
+  if (!manifest) {
+    close(fd);
+    set->files = malloc(sizeof(BackupFile));
+    if (set->files == NULL || backup_open(&set->files[0], path) != 0) {
+      free(set->files);
+      set->files = NULL;
+      return 1;
+    }
+    set->num_files = 1;
+    set->num_blocks = set->files[0].num_blocks;
+    set->info = set->files[0].info;
+    return 0;
+  }
+
+  unsigned char body[MAX_MANIFEST_NAMES];
+  size_t len = (size_t)st.st_size - sizeof(header);
+  int failed = len > sizeof(body) || read_all(fd, body, len, NULL) != 1;
+  close(fd);
+  if (failed) {
+    fprintf(stderr, "Backup manifest %s is malformed\n", path);
+    return 1;
+  }
+  if (open_segments(set, path, header, body, len) != 0) {
+    backup_set_close(set);
+    return 1;
+  }
+  return 0;
+}
+
+const BackupFile *backup_set_block(const BackupSet *set, uint64_t block, uint64_t *index) {
+  size_t i = 0;
+  while (i + 1 < set->num_files && block >= set->files[i].num_blocks) {
+    block -= set->files[i].num_blocks;
+    i++;
+  }
+  *index = block;
+  return &set->files[i];
+}
+
+void backup_set_close(BackupSet *set) {
+  for (size_t i = 0; i < set->num_files; i++) {
+    backup_close(&set->files[i]);
+  }
+  free(set->files);
+  set->files = NULL;
+  set->num_files = 0;
+}
@@ -0,0 +1,182 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Binary backup format, every integer little endian:
+//
+//   header   magic "KVSBACK\0", u32 format version, u32 entries per block,
+//            u64 entry count, u64 block count, u64 index offset,
+//            u64 checksum (FNV-1a of everything after the header),
+//            u32 kind, u32 compression, u64 stream, u64 snapshot, u64 base
+//   records  u8 key length, u8 value length, key, value; sorted by key
+//   index    u64 file offset of the first record of every block
+//
+// Blocks hold BACKUP_BLOCK_ENTRIES records, the last one may hold fewer, so
+// that a restore can hand whole blocks to different threads.
+//
+// Compressed backups store every block apart instead of the bare records:
+//
+//   block    u32 stored length, u32 length of the records, u32 CRC32C of
+//            the records, the records compressed (see lz.h), or as they are
+//            when both lengths are the same
+//
+// and the index then gives the offset of every block.
+//
+// A full backup holds every pair of a snapshot. A delta only holds what
+// changed since the previous backup of its stream, whose snapshot is its
+// base, with BACKUP_TOMBSTONE as the value length of deleted keys. A chain
+// is a full backup followed by the deltas of the same stream, each based on
+// the one before.
+//
+// A backup may also be split in segments, written in parallel: binary
+// backups of consecutive key ranges, with the same header fields, listed by
+// a manifest that takes the backup's name:
+//
+//   manifest magic "KVSSEGS\0", u32 format version, u32 segment count,
+//            u64 checksum (FNV-1a of the names),
+//            u32 kind, u32 zero, u64 stream, u64 snapshot, u64 base
+//   names    u8 length and file name of every segment, in key order, the
+//            files being in the manifest's directory
+
+#define BACKUP_FORMAT_VERSION 2
+#define BACKUP_HEADER_SIZE 80
+#define BACKUP_BLOCK_ENTRIES MAX_WRITE_SIZE // a block is restored as one batch
+#define BACKUP_TOMBSTONE 0xff
+#define BACKUP_BLOCK_HEADER_SIZE 12
+// largest block of records: both strings as long as they can be in each
+#define BACKUP_MAX_BLOCK_SIZE (BACKUP_BLOCK_ENTRIES * (2 + 2 * (MAX_STRING_SIZE - 1)))
+#define BACKUP_MANIFEST_HEADER_SIZE 56
+#define MAX_BACKUP_SEGMENTS 64
+
+typedef enum { BACKUP_TEXT, BACKUP_BINARY } BackupFormat;
+
+typedef enum { BACKUP_FULL, BACKUP_DELTA } BackupKind;
+
+typedef enum { BACKUP_UNCOMPRESSED, BACKUP_LZ } BackupCompression;
+
+/// Where a backup sits in its chain.
+typedef struct {
+  BackupKind kind;
+  uint64_t stream;   // identifies the chain
+  uint64_t snapshot; // version the backup was taken at
+  uint64_t base;     // snapshot of the previous backup, for deltas
+} BackupInfo;
+
+typedef struct BackupWriter BackupWriter;
+
+/// A binary backup mapped in memory.
+typedef struct {
+  const unsigned char *data;
+  size_t size;
+  uint64_t num_entries;
+  uint64_t num_blocks;
+  const unsigned char *index;
+  BackupCompression compression;
+  BackupInfo info;
+} BackupFile;
+
+/// A whole backup: one binary backup, or the segments of a manifest.
+typedef struct {
+  BackupFile *files; // in key order
+  size_t num_files;
+  uint64_t num_blocks; // over every file
+  BackupInfo info;
+} BackupSet;
+
+/// Reads the records of a backup in order.
+typedef struct {
+  const BackupFile *file;
+  const unsigned char *data; // records being read: the file's, or a block's
+  uint64_t offset;           // of the next record in data
+  uint64_t end;              // of the records in data
+  uint64_t block;            // next block to decompress
+  uint64_t left;             // records left to read
+  unsigned char raw[BACKUP_MAX_BLOCK_SIZE]; // decompressed block
+} BackupReader;
+
+/// Starts writing a binary backup.
+/// @param fd File descriptor of the backup file, at its start.
+/// @param compression How the blocks are stored.
+/// @return The writer, NULL on failure.
+BackupWriter *backup_writer_open(int fd, BackupCompression compression);
+
+/// Adds a record. Keys must come in increasing order.
+/// @param writer Writer.
+/// @param key Key.
+/// @param value Value, NULL for a deleted key.
+/// @return 0 on success, 1 otherwise.
+int backup_writer_put(BackupWriter *writer, const char *key, const char *value);
+
+/// Writes the index and the header, and frees the writer.
+/// @param writer Writer.
+/// @param info Header fields of the backup.
+/// @param failed Non zero if the backup is given up, only the writer is freed.
+/// @return 0 if the backup was written, 1 otherwise.
+int backup_writer_close(BackupWriter *writer, const BackupInfo *info, int failed);
+
+/// Maps a binary backup and checks its header and checksum.
+/// @param file Filled with the mapping.
+/// @param path Path of the backup.
+/// @return 0 if the backup can be read, 1 otherwise.
+int backup_open(BackupFile *file, const char *path);
+
+/// Starts reading a backup at the beginning of a block.
+/// @param reader Reader to set up.
+/// @param file Backup opened by backup_open.
+/// @param block Index of the block.
+/// @return 0 on success, 1 if there is no such block.
+int backup_reader_init(BackupReader *reader, const BackupFile *file, uint64_t block);
+
+/// Reads the next record.
+/// @param reader Reader.
+/// @param key Filled with the key.
+/// @param value Filled with the value, empty for a deleted key.
+/// @param deleted Set to 1 for a deleted key, 0 otherwise.
+/// @return 1 if a record was read, 0 at the end, -1 if the backup is malformed.
+int backup_reader_next(BackupReader *reader, char *key, char *value, int *deleted);
+
+/// Decodes a block of a full backup, decompressing it if needed. Safe to
+/// call from several threads.
+/// @param file Backup opened by backup_open.
+/// @param block Index of the block.
+/// @param keys Filled with the keys of the block.
+/// @param values Filled with the values of the block.
+/// @return Number of pairs in the block, -1 if it is malformed.
+int backup_read_block(const BackupFile *file, uint64_t block,
+                      char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+
+/// Unmaps a backup.
+/// @param file Backup opened by backup_open.
+void backup_close(BackupFile *file);
+
+/// Writes the manifest of a backup split in segments, once they are written.
+/// @param fd File descriptor of the manifest, at its start.
+/// @param info Header fields of the backup, the same as the segments'.
+/// @param num_segments Number of segments.
+/// @param names File names of the segments, in key order.
+/// @return 0 on success, 1 otherwise.
+int backup_manifest_write(int fd, const BackupInfo *info, size_t num_segments,
+                          const char *const *names);
+
+/// Opens a backup, either a binary backup or a manifest and all its segments.
+/// @param set Filled with the files of the backup.
+/// @param path Path of the backup or of the manifest.
+/// @return 0 if every file can be read, 1 otherwise.
+int backup_set_open(BackupSet *set, const char *path);
+
+/// Finds the block of a backup with a given index over all its files.
+/// @param set Backup opened by backup_set_open.
+/// @param block Index of the block, smaller than set->num_blocks.
+/// @param index Set to the index of the block in its file.
+/// @return The file holding the block.
+const BackupFile *backup_set_block(const BackupSet *set, uint64_t block, uint64_t *index);
+
+/// Unmaps every file of a backup.
+/// @param set Backup opened by backup_set_open.
+void backup_set_close(BackupSet *set);
+
+#endif  // KVS_BACKUP_H
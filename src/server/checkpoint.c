@@ -0,0 +1,335 @@
+#include "checkpoint.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "cursor.h"
+#include "io.h"
+#include "throttle.h"
+
+#define CHECKPOINT_CHUNK 256 // pairs copied at a time
+#define CHECKPOINT_PREFIX "checkpoint-"
+
+typedef struct {
+  unsigned long written;
+  unsigned long failed;
+  uint64_t last_pairs;
+  uint64_t last_bytes;
+  uint64_t last_ms;
+  uint64_t slowest_ms;
+  uint64_t total_ms;
+} CheckpointStats;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;   // stopping, or enough writes
+  pthread_t thread;
+  int running;
+  int stopping;
+  const CheckpointConfig *config;
+  unsigned long next_seq;
+  CheckpointStats stats;
+} checkpoints = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, 1,
+                 {0, 0, 0, 0, 0, 0, 0}};
+
+static atomic_size_t writes_since = 0;
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Parses "checkpoint-<seq><suffix>".
+// @return 1 if the name has that form, 0 otherwise.
+static int parse_name(const char *name, const char *suffix, unsigned long *seq) {
+  size_t prefix_len = strlen(CHECKPOINT_PREFIX);
+  if (strncmp(name, CHECKPOINT_PREFIX, prefix_len) != 0 ||
+      name[prefix_len] < '0' || name[prefix_len] > '9') {
+    return 0;
+  }
+  char *end;
+  *seq = strtoul(name + prefix_len, &end, 10);
+  return strcmp(end, suffix) == 0;
+}
+
+static void checkpoint_path(char *path, size_t size, unsigned long seq, const char *suffix) {
+  snprintf(path, size, "%s/" CHECKPOINT_PREFIX "%010lu%s", checkpoints.config->directory,
+           seq, suffix);
+}
+
+// Deletes the checkpoints older than the last kept ones, and what a crash in
+// the middle of a checkpoint left behind.
+static void remove_old(unsigned long newest) {
+  DIR *dir = opendir(checkpoints.config->directory);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned long seq;
+    int old = parse_name(entry->d_name, ".bck", &seq) &&
+              seq + checkpoints.config->kept <= newest;
+    if (old || (parse_name(entry->d_name, ".tmp", &seq) && seq < newest)) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", checkpoints.config->directory, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+// Writes the current snapshot to a new checkpoint.
+// @return 0 on success, 1 otherwise.
+static int write_checkpoint(unsigned long seq, CheckpointStats *stats) {
+  char tmp_path[PATH_MAX];
+  char path[PATH_MAX];
+  checkpoint_path(tmp_path, sizeof(tmp_path), seq, ".tmp");
+  checkpoint_path(path, sizeof(path), seq, ".bck");
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return 1;
+  }
+  CursorPair *pairs = malloc(CHECKPOINT_CHUNK * sizeof(CursorPair));
+  Cursor *cursor = pairs == NULL ? NULL : cursor_open();
+  BackupWriter *writer = cursor == NULL ? NULL : backup_writer_open(fd, checkpoints.config->compression);
+  int failed = writer == NULL;
+
+  // the cursor only holds an epoch for a chunk at a time, so writers and the
+  // memory they free are never held up for the whole checkpoint
+  uint64_t num_pairs = 0;
+  size_t count;
+  while (!failed && (count = cursor_next(cursor, pairs, CHECKPOINT_CHUNK)) > 0) {
+    throttle_acquire(cursor_pairs_size(pairs, count) + count * 2);
+    for (size_t i = 0; i < count && !failed; i++) {
+      failed = backup_writer_put(writer, pairs[i].key, pairs[i].value);
+    }
+    num_pairs += count;
+  }
+  if (writer != NULL) {
+    BackupInfo info = {BACKUP_FULL, seq, cursor_snapshot(cursor), 0};
+    failed = backup_writer_close(writer, &info, failed);
+  }
+  if (cursor != NULL) {
+    cursor_close(cursor);
+  }
+  free(pairs);
+
+  struct stat st;
+  failed = failed || fdatasync(fd) != 0 || fstat(fd, &st) != 0;
+  failed = close(fd) != 0 || failed;
+  if (failed || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return 1;
+  }
+
+  // the rename itself has to reach the disk
+  int dir_fd = open(checkpoints.config->directory, O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  stats->last_pairs = num_pairs;
+  stats->last_bytes = (uint64_t)st.st_size;
+  return 0;
+}
+
+// Whether a checkpoint is due. Called with the lock held.
+static int due(uint64_t last_end, uint64_t *wait_ms) {
+  const CheckpointConfig *config = checkpoints.config;
+  if (config->writes > 0 && atomic_load(&writes_since) >= config->writes) {
+    return 1;
+  }
+  if (config->interval_ms > 0) {
+    uint64_t now = now_ms();
+    if (now >= last_end + config->interval_ms) {
+      return 1;
+    }
+    *wait_ms = last_end + config->interval_ms - now;
+  }
+  return 0;
+}
+
+static void wait_for(uint64_t wait_ms) {
+  if (wait_ms == 0) {
+    pthread_cond_wait(&checkpoints.wake, &checkpoints.lock);
+    return;
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)(wait_ms / 1000);
+  deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&checkpoints.wake, &checkpoints.lock, &deadline);
+}
+
+static void *checkpoint_thread(void *arg) {
+  (void)arg;
+  // signals are left to the main thread, like in the job threads
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  uint64_t last_end = now_ms();
+  uint64_t last_ms = 0;
+
+  pthread_mutex_lock(&checkpoints.lock);
+  while (!checkpoints.stopping) {
+    // the checkpointer rests at least as long as the last checkpoint took,
+    // so it never keeps more than half a CPU busy, however many writes come
+    uint64_t now = now_ms();
+    uint64_t wait_ms = 0;
+    if (now < last_end + last_ms) {
+      wait_for(last_end + last_ms - now);
+      continue;
+    }
+    if (!due(last_end, &wait_ms)) {
+      wait_for(wait_ms);
+      continue;
+    }
+
+    unsigned long seq = checkpoints.next_seq++;
+    pthread_mutex_unlock(&checkpoints.lock);
+
+    atomic_store(&writes_since, 0);
+    uint64_t start = now_ms();
+    CheckpointStats stats = {0, 0, 0, 0, 0, 0, 0};
+    int failed = write_checkpoint(seq, &stats);
+    if (failed) {
+      fprintf(stderr, "Failed to write checkpoint %lu\n", seq);
+    } else {
+      remove_old(seq);
+    }
+    last_end = now_ms();
+    last_ms = last_end - start;
+
+    pthread_mutex_lock(&checkpoints.lock);
+    if (failed) {
+      checkpoints.stats.failed++;
+    } else {
+      checkpoints.stats.written++;
+      checkpoints.stats.last_pairs = stats.last_pairs;
+      checkpoints.stats.last_bytes = stats.last_bytes;
+      checkpoints.stats.last_ms = last_ms;
+    }
+    if (last_ms > checkpoints.stats.slowest_ms) {
+      checkpoints.stats.slowest_ms = last_ms;
+    }
+    checkpoints.stats.total_ms += last_ms;
+  }
+  pthread_mutex_unlock(&checkpoints.lock);
+  return NULL;
+}
+
+int checkpoint_latest(const char *directory, char *path, size_t size) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    return 1;
+  }
+  int found = 0;
+  unsigned long newest = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned long seq;
+    if (parse_name(entry->d_name, ".bck", &seq) && (!found || seq > newest)) {
+      newest = seq;
+      found = 1;
+    }
+  }
+  closedir(dir);
+  if (found) {
+    snprintf(path, size, "%s/" CHECKPOINT_PREFIX "%010lu.bck", directory, newest);
+  }
+  return !found;
+}
+
+int checkpoint_start(const CheckpointConfig *config) {
+  if (mkdir(config->directory, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create checkpoint directory %s\n", config->directory);
+    return 1;
+  }
+
+  // numbering goes on after the checkpoints already there
+  char path[PATH_MAX];
+  unsigned long newest = 0;
+  if (checkpoint_latest(config->directory, path, sizeof(path)) == 0) {
+    const char *name = strrchr(path, '/') + 1;
+    parse_name(name, ".bck", &newest);
+  }
+
+  pthread_mutex_lock(&checkpoints.lock);
+  checkpoints.config = config;
+  checkpoints.next_seq = newest + 1;
+  checkpoints.stopping = 0;
+  int err = pthread_create(&checkpoints.thread, NULL, checkpoint_thread, NULL);
+  checkpoints.running = err == 0;
+  pthread_mutex_unlock(&checkpoints.lock);
+  if (err != 0) {
+    fprintf(stderr, "Failed to start the checkpointer\n");
+    return 1;
+  }
+  return 0;
+}
+
+void checkpoint_note_writes(size_t num_keys) {
+  const CheckpointConfig *config = checkpoints.config;
+  if (config == NULL || config->writes == 0) {
+    return;
+  }
+  size_t before = atomic_fetch_add(&writes_since, num_keys);
+  if (before < config->writes && before + num_keys >= config->writes) {
+    pthread_mutex_lock(&checkpoints.lock);
+    pthread_cond_signal(&checkpoints.wake);
+    pthread_mutex_unlock(&checkpoints.lock);
+  }
+}
+
+void checkpoint_stop() {
+  pthread_mutex_lock(&checkpoints.lock);
+  int running = checkpoints.running;
+  checkpoints.stopping = 1;
+  checkpoints.running = 0;
+  pthread_cond_signal(&checkpoints.wake);
+  pthread_mutex_unlock(&checkpoints.lock);
+  if (running) {
+    pthread_join(checkpoints.thread, NULL);
+  }
+}
+
+void checkpoint_report(int fd) {
+  pthread_mutex_lock(&checkpoints.lock);
+  CheckpointStats stats = checkpoints.stats;
+  int enabled = checkpoints.config != NULL;
+  pthread_mutex_unlock(&checkpoints.lock);
+  if (!enabled) {
+    return;
+  }
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "Checkpoints: %lu written, %lu failed, last %lu pairs, %lu bytes in %lu ms, "
+           "slowest %lu ms, %lu ms in total\n",
+           stats.written, stats.failed, (unsigned long)stats.last_pairs,
+           (unsigned long)stats.last_bytes, (unsigned long)stats.last_ms,
+           (unsigned long)stats.slowest_ms, (unsigned long)stats.total_ms);
+  write_str(fd, line);
+}
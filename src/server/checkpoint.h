@@ -0,0 +1,44 @@
+#ifndef KVS_CHECKPOINT_H
+#define KVS_CHECKPOINT_H
+
+#include <stddef.h>
+
+#include "backup.h"
+
+// Checkpoints: full binary backups (see backup.h) the server writes on its
+// own, every so often, from a snapshot, so foreground traffic never waits for
+// them. Each one is written aside and renamed into place, and only the last
+// few are kept, so the newest complete one can always be restored.
+
+typedef struct {
+  const char *directory;
+  unsigned long interval_ms; // 0 to not checkpoint on time
+  size_t writes;             // keys written between checkpoints, 0 to not count
+  size_t kept;               // checkpoints kept, at least 1
+  BackupCompression compression;
+} CheckpointConfig;
+
+/// Starts the checkpointer thread.
+/// @param config When and where to checkpoint, must outlive the thread.
+/// @return 0 on success, 1 otherwise.
+int checkpoint_start(const CheckpointConfig *config);
+
+/// Counts keys written, for checkpoints based on the number of writes.
+/// @param num_keys Keys written or deleted.
+void checkpoint_note_writes(size_t num_keys);
+
+/// Stops the checkpointer thread, letting a checkpoint in progress finish.
+void checkpoint_stop();
+
+/// Finds the newest checkpoint of a directory.
+/// @param directory Directory of the checkpoints.
+/// @param path Filled with the path of the checkpoint.
+/// @param size Size of path.
+/// @return 0 if one was found, 1 otherwise.
+int checkpoint_latest(const char *directory, char *path, size_t size);
+
+/// Writes the checkpoint statistics.
+/// @param fd File descriptor to write to.
+void checkpoint_report(int fd);
+
+#endif  // KVS_CHECKPOINT_H
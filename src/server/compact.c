@@ -0,0 +1,158 @@
+// Merges a chain of binary backups, a full backup followed by its deltas,
+// into one full backup that --restore can load. Backups split in segments
+// are given by their manifest.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+
+// Next record of one backup of the chain.
+typedef struct {
+  const BackupSet *set;
+  size_t segment;    // segment being read
+  BackupReader reader;
+  int valid;         // 0 once the backup is exhausted
+  int deleted;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} ChainHead;
+
+static int advance(ChainHead *head) {
+  while (1) {
+    int read = backup_reader_next(&head->reader, head->key, head->value, &head->deleted);
+    head->valid = read == 1;
+    if (read != 0) {
+      return read < 0;
+    }
+    // segments hold consecutive key ranges, the next one follows on
+    do {
+      head->segment++;
+    } while (head->segment < head->set->num_files &&
+             backup_reader_init(&head->reader, &head->set->files[head->segment], 0) != 0);
+    if (head->segment >= head->set->num_files) {
+      return 0;
+    }
+  }
+}
+
+// Starts reading a backup at its first record.
+static int start(ChainHead *head, const BackupSet *set) {
+  head->set = set;
+  head->segment = 0;
+  backup_reader_init(&head->reader, &set->files[0], 0); // left at 0 if it is empty
+  return advance(head);
+}
+
+// Checks that each backup is based on the one before it.
+static int check_chain(BackupSet *backups, int num_backups, char **paths) {
+  if (backups[0].info.kind != BACKUP_FULL) {
+    fprintf(stderr, "%s is not a full backup\n", paths[0]);
+    return 1;
+  }
+  for (int i = 1; i < num_backups; i++) {
+    if (backups[i].info.kind != BACKUP_DELTA ||
+        backups[i].info.stream != backups[0].info.stream ||
+        backups[i].info.base != backups[i - 1].info.snapshot) {
+      fprintf(stderr, "%s does not follow %s\n", paths[i], paths[i - 1]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Writes the merge of the chain, the newest record of each key winning.
+static int merge(BackupSet *backups, int num_backups, int fd) {
+  ChainHead *heads = calloc((size_t)num_backups, sizeof(ChainHead));
+  // the merge is compressed like the full backup of the chain
+  BackupWriter *writer =
+      heads == NULL ? NULL : backup_writer_open(fd, backups[0].files[0].compression);
+  if (writer == NULL) {
+    free(heads);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 0; i < num_backups && !failed; i++) {
+    failed = start(&heads[i], &backups[i]);
+  }
+
+  while (!failed) {
+    int newest = -1;
+    for (int i = 0; i < num_backups; i++) {
+      if (heads[i].valid &&
+          (newest < 0 || strcmp(heads[i].key, heads[newest].key) <= 0)) {
+        newest = i; // on equal keys the later backup wins
+      }
+    }
+    if (newest < 0) {
+      break;
+    }
+
+    if (!heads[newest].deleted) {
+      failed = backup_writer_put(writer, heads[newest].key, heads[newest].value);
+    }
+    char key[MAX_STRING_SIZE];
+    strcpy(key, heads[newest].key);
+    for (int i = 0; i < num_backups && !failed; i++) {
+      if (heads[i].valid && strcmp(heads[i].key, key) == 0) {
+        failed = advance(&heads[i]);
+      }
+    }
+  }
+
+  const BackupInfo *last = &backups[num_backups - 1].info;
+  BackupInfo info = {BACKUP_FULL, last->stream, last->snapshot, 0};
+  failed = backup_writer_close(writer, &info, failed);
+  free(heads);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <output> <full backup> [delta backups...]\n", argv[0]);
+    return 1;
+  }
+
+  int num_backups = argc - 2;
+  char **paths = argv + 2;
+  BackupSet *backups = calloc((size_t)num_backups, sizeof(BackupSet));
+  if (backups == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  int opened = 0;
+  while (opened < num_backups && backup_set_open(&backups[opened], paths[opened]) == 0) {
+    opened++;
+  }
+
+  int failed = opened < num_backups || check_chain(backups, num_backups, paths);
+  if (!failed) {
+    // written aside and renamed, so the output may replace a backup of the chain
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", argv[1]);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open %s\n", tmp_path);
+      failed = 1;
+    } else {
+      failed = merge(backups, num_backups, fd);
+      failed = close(fd) != 0 || failed;
+      if (failed || rename(tmp_path, argv[1]) != 0) {
+        fprintf(stderr, "Failed to write %s\n", argv[1]);
+        unlink(tmp_path);
+        failed = 1;
+      }
+    }
+  }
+
+  for (int i = 0; i < opened; i++) {
+    backup_set_close(&backups[i]);
+  }
+  free(backups);
+  return failed;
+}
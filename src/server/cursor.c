@@ -0,0 +1,134 @@
+#include "cursor.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "shard.h"
+#include "snapshot.h"
+
+struct Cursor {
+  SnapshotHold *hold;
+  uint64_t snapshot;
+  int changes;                   // only dump what changed since since
+  uint64_t since;
+  int started;                   // 0 until the first pair is dumped
+  char last[MAX_STRING_SIZE];    // last key dumped
+  char first[MAX_STRING_SIZE];   // first key of a part, empty to start at the first key
+  char end[MAX_STRING_SIZE];     // key after the part, empty to go on until the last one
+};
+
+struct CopyArgs {
+  const Cursor *cursor;
+  CursorPair *pairs;
+  size_t count;
+  size_t max_pairs;
+};
+
+static int copy_pair(const char *key, const char *value, int value_len, void *arg) {
+  struct CopyArgs *args = arg;
+  if (args->cursor->end[0] != '\0' && strncmp(key, args->cursor->end, MAX_STRING_SIZE - 1) >= 0) {
+    return 1;
+  }
+  if (args->cursor->started && strncmp(key, args->cursor->last, MAX_STRING_SIZE - 1) == 0) {
+    return 0; // dumped by the previous chunk
+  }
+  CursorPair *pair = &args->pairs[args->count++];
+  strcpy(pair->key, key);
+  pair->deleted = value == NULL;
+  if (value_len > 0) {
+    memcpy(pair->value, value, (size_t)value_len);
+  }
+  pair->value[value_len] = '\0';
+  return args->count == args->max_pairs;
+}
+
+Cursor *cursor_open() {
+  Cursor *cursor = calloc(1, sizeof(Cursor));
+  if (cursor == NULL) {
+    return NULL;
+  }
+  cursor->hold = snapshot_hold(&cursor->snapshot);
+  return cursor;
+}
+
+Cursor *cursor_open_since(uint64_t since) {
+  Cursor *cursor = cursor_open();
+  if (cursor != NULL) {
+    cursor->changes = 1;
+    cursor->since = since;
+  }
+  return cursor;
+}
+
+Cursor *cursor_open_part(const Cursor *cursor, const char *first, const char *end) {
+  Cursor *part = calloc(1, sizeof(Cursor));
+  if (part == NULL) {
+    return NULL;
+  }
+  part->hold = snapshot_hold_at(cursor->snapshot);
+  part->snapshot = cursor->snapshot;
+  part->changes = cursor->changes;
+  part->since = cursor->since;
+  if (first != NULL) {
+    strcpy(part->first, first);
+  }
+  if (end != NULL) {
+    strcpy(part->end, end);
+  }
+  return part;
+}
+
+size_t cursor_split_keys(size_t parts, char splits[][MAX_STRING_SIZE]) {
+  // the shards hold keys spread by their hash, so any of them splits the
+  // whole store alike
+  epoch_enter();
+  size_t num_splits = split_keys(shard_table(0), parts, splits);
+  epoch_exit();
+  return num_splits;
+}
+
+uint64_t cursor_snapshot(const Cursor *cursor) {
+  return cursor->snapshot;
+}
+
+size_t cursor_pairs_size(const CursorPair *pairs, size_t count) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += strlen(pairs[i].key) + strlen(pairs[i].value);
+  }
+  return size;
+}
+
+void cursor_close(Cursor *cursor) {
+  snapshot_release(cursor->hold);
+  free(cursor);
+}
+
+size_t cursor_next(Cursor *cursor, CursorPair *pairs, size_t max_pairs) {
+  struct CopyArgs args = {cursor, pairs, 0, max_pairs};
+  if (max_pairs == 0) {
+    return 0;
+  }
+
+  // the epoch only lasts a chunk, so memory freed meanwhile is not held back
+  // for the whole dump, only the versions the snapshot reads are
+  epoch_enter();
+  const char *from = cursor->started ? cursor->last : NULL;
+  if (from == NULL && cursor->first[0] != '\0') {
+    from = cursor->first;
+  }
+  if (cursor->changes) {
+    foreach_change(cursor->snapshot, cursor->since, from, copy_pair, &args);
+  } else {
+    foreach_range(cursor->snapshot, from, copy_pair, &args);
+  }
+  epoch_exit();
+
+  if (args.count > 0) {
+    strcpy(cursor->last, pairs[args.count - 1].key);
+    cursor->started = 1;
+  }
+  return args.count;
+}
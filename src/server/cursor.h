@@ -0,0 +1,72 @@
+#ifndef KVS_CURSOR_H
+#define KVS_CURSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// A cursor dumps every pair of the store, in key order, a chunk at a time.
+// It pins a snapshot when opened (see snapshot.h) and reads it without
+// locks, so the dump is the state the store had then, whatever the writers
+// do meanwhile.
+
+/// Pair copied out of the store.
+typedef struct {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  int deleted;                // only in dumps of changes, value is then empty
+} CursorPair;
+
+typedef struct Cursor Cursor;
+
+/// Opens a cursor at the first key of the store. The snapshot is pinned apart
+/// from the thread, so the cursor may be handed to another thread, as long as
+/// only one uses it at a time.
+/// @return The cursor, NULL on failure.
+Cursor *cursor_open();
+
+/// Opens a cursor that only dumps what changed since an older snapshot: the
+/// pairs whose value is not the one they had then, and the deleted ones.
+/// @param since The older snapshot, which must stay pinned until the cursor
+///              is closed.
+/// @return The cursor, NULL on failure.
+Cursor *cursor_open_since(uint64_t since);
+
+/// Opens a cursor over a part of the dump of another cursor, the same
+/// snapshot and, for a dump of changes, the same older snapshot. Cursors over
+/// the parts of a dump can be used by different threads at once.
+/// @param cursor The cursor of the whole dump, open until this returns.
+/// @param first First key of the part, NULL to start at the first key.
+/// @param end First key after the part, NULL to go on until the last key.
+/// @return The cursor, NULL on failure.
+Cursor *cursor_open_part(const Cursor *cursor, const char *first, const char *end);
+
+/// Picks keys that split a dump in parts of about the same size, which
+/// cursor_open_part can then dump in parallel.
+/// @param parts Number of parts wanted.
+/// @param splits Filled with the first key of every part but the first.
+/// @return Number of keys picked, at most parts - 1, fewer for small stores.
+size_t cursor_split_keys(size_t parts, char splits[][MAX_STRING_SIZE]);
+
+/// @param cursor An open cursor.
+/// @return The snapshot the cursor dumps.
+uint64_t cursor_snapshot(const Cursor *cursor);
+
+/// Copies the next pairs of the dump.
+/// @param cursor Cursor to advance.
+/// @param pairs Filled with the pairs, in key order.
+/// @param max_pairs Maximum number of pairs to copy.
+/// @return Number of pairs copied, 0 once the dump is over.
+size_t cursor_next(Cursor *cursor, CursorPair *pairs, size_t max_pairs);
+
+/// @param pairs Pairs copied by cursor_next.
+/// @param count Number of pairs.
+/// @return Bytes of their keys and values.
+size_t cursor_pairs_size(const CursorPair *pairs, size_t count);
+
+/// Closes a cursor, releasing its snapshot.
+/// @param cursor Cursor to close.
+void cursor_close(Cursor *cursor);
+
+#endif  // KVS_CURSOR_H
@@ -0,0 +1,61 @@
+#ifndef KVS_ENCODE_H
+#define KVS_ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Little endian integers and checksums of the files the server writes.
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline void put_u16(unsigned char *p, uint16_t value) {
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8);
+}
+
+static inline void put_u32(unsigned char *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static inline void put_u64(unsigned char *p, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static inline uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/// FNV-1a, continued from a previous value.
+/// @param h FNV_OFFSET, or the checksum of the bytes before.
+/// @param data Bytes to add.
+/// @param len Number of bytes.
+/// @return The checksum.
+static inline uint64_t fnv1a(uint64_t h, const unsigned char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ data[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+#endif  // KVS_ENCODE_H
@@ -0,0 +1,205 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COLLECT_THRESHOLD 64 // retires between two collection attempts
+
+typedef struct {
+  void *ptr;
+  retire_fn free_fn;
+  uint64_t epoch; // global epoch when ptr was retired
+} Retired;
+
+typedef struct {
+  Retired *items;
+  size_t count;
+  size_t capacity;
+} RetiredList;
+
+// One record per thread, kept in a global list that only grows. Records of
+// threads that exited are reused by new threads.
+typedef struct EpochRecord {
+  _Alignas(64) atomic_uint_fast64_t state; // (epoch << 1) | active
+  atomic_int in_use;
+  int nesting;
+  size_t since_collect;
+  RetiredList retired;
+  struct EpochRecord *next;
+} EpochRecord;
+
+static atomic_uint_fast64_t global_epoch = 0;
+static _Atomic(EpochRecord *) records = NULL;
+
+// retired pointers left behind by threads that exited
+static RetiredList orphans = {NULL, 0, 0};
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static _Thread_local EpochRecord *self = NULL;
+
+static int retired_push(RetiredList *list, Retired item) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity == 0 ? COLLECT_THRESHOLD : list->capacity * 2;
+    Retired *items = realloc(list->items, capacity * sizeof(Retired));
+    if (items == NULL) {
+      return 1;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = item;
+  return 0;
+}
+
+// Frees the pointers retired at least two epochs before the given one.
+static void retired_free_safe(RetiredList *list, uint64_t epoch) {
+  size_t kept = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    if (list->items[i].epoch + 2 <= epoch) {
+      list->items[i].free_fn(list->items[i].ptr);
+    } else {
+      list->items[kept++] = list->items[i];
+    }
+  }
+  list->count = kept;
+}
+
+static void retired_free_all(RetiredList *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    list->items[i].free_fn(list->items[i].ptr);
+  }
+  free(list->items);
+  list->items = NULL;
+  list->count = 0;
+  list->capacity = 0;
+}
+
+// Thread exit: hand what is still pending to the orphans and free the record.
+static void release_record(void *arg) {
+  EpochRecord *record = arg;
+
+  pthread_mutex_lock(&orphans_lock);
+  for (size_t i = 0; i < record->retired.count; i++) {
+    if (retired_push(&orphans, record->retired.items[i]) != 0) {
+      fprintf(stderr, "Failed to keep retired memory, leaking it\n");
+      break;
+    }
+  }
+  pthread_mutex_unlock(&orphans_lock);
+  record->retired.count = 0;
+
+  record->nesting = 0;
+  atomic_store(&record->state, 0);
+  atomic_store(&record->in_use, 0);
+}
+
+static void create_record_key() {
+  pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *get_record() {
+  if (self != NULL) {
+    return self;
+  }
+  pthread_once(&record_key_once, create_record_key);
+
+  for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+      self = r;
+      break;
+    }
+  }
+
+  if (self == NULL) {
+    EpochRecord *r = aligned_alloc(_Alignof(EpochRecord), sizeof(EpochRecord));
+    if (r == NULL) {
+      perror("Failed to allocate epoch record");
+      exit(EXIT_FAILURE);
+    }
+    atomic_init(&r->state, 0);
+    atomic_init(&r->in_use, 1);
+    r->nesting = 0;
+    r->since_collect = 0;
+    r->retired = (RetiredList){NULL, 0, 0};
+    r->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &r->next, r))
+      ;
+    self = r;
+  }
+
+  pthread_setspecific(record_key, self);
+  return self;
+}
+
+// Moves the global epoch forward if every active reader already saw it.
+// @return The current global epoch.
+static uint64_t try_advance() {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+    uint64_t state = atomic_load(&r->state);
+    if ((state & 1) && (state >> 1) != epoch) {
+      return epoch;
+    }
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+    return epoch + 1;
+  }
+  return epoch; // updated by the failed exchange
+}
+
+void epoch_enter() {
+  EpochRecord *r = get_record();
+  if (r->nesting++ == 0) {
+    uint64_t epoch = atomic_load(&global_epoch);
+    atomic_store(&r->state, (epoch << 1) | 1);
+  }
+}
+
+void epoch_exit() {
+  EpochRecord *r = get_record();
+  if (--r->nesting == 0) {
+    atomic_store_explicit(&r->state, 0, memory_order_release);
+  }
+}
+
+void epoch_retire(void *ptr, retire_fn free_fn) {
+  if (ptr == NULL) {
+    return;
+  }
+  EpochRecord *r = get_record();
+  Retired item = {ptr, free_fn, atomic_load(&global_epoch)};
+  if (retired_push(&r->retired, item) != 0) {
+    fprintf(stderr, "Failed to retire memory, leaking it\n");
+    return;
+  }
+  if (++r->since_collect >= COLLECT_THRESHOLD) {
+    r->since_collect = 0;
+    epoch_collect();
+  }
+}
+
+void epoch_collect() {
+  EpochRecord *r = get_record();
+  uint64_t epoch = try_advance();
+  retired_free_safe(&r->retired, epoch);
+
+  if (pthread_mutex_trylock(&orphans_lock) == 0) {
+    retired_free_safe(&orphans, epoch);
+    pthread_mutex_unlock(&orphans_lock);
+  }
+}
+
+void epoch_terminate() {
+  for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+    retired_free_all(&r->retired);
+  }
+  pthread_mutex_lock(&orphans_lock);
+  retired_free_all(&orphans);
+  pthread_mutex_unlock(&orphans_lock);
+}
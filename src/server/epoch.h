@@ -0,0 +1,30 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Epoch based reclamation: memory unlinked from a structure that is read
+// without locks is only freed once every thread that could still be reading
+// it has left its critical section.
+
+/// Function used to free a retired pointer.
+typedef void (*retire_fn)(void *ptr);
+
+/// Enters a read critical section. Pointers loaded from lock free structures
+/// stay valid until the matching epoch_exit. May be nested.
+void epoch_enter();
+
+/// Leaves a read critical section.
+void epoch_exit();
+
+/// Frees ptr with free_fn once no reader can be holding it anymore.
+/// @param ptr Pointer already unlinked from every shared structure.
+/// @param free_fn Function that releases ptr.
+void epoch_retire(void *ptr, retire_fn free_fn);
+
+/// Tries to advance the global epoch and frees what became safe to free.
+void epoch_collect();
+
+/// Frees everything still waiting to be reclaimed. Only safe when no other
+/// thread is using the structures anymore.
+void epoch_terminate();
+
+#endif  // KVS_EPOCH_H
@@ -0,0 +1,367 @@
+#include "executor.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encode.h"
+#include "io.h"
+
+#define KEY_SLOTS 16384  // power of two, the keys of every pending command
+                         // fill half of it at most
+
+// Commands of a job executing or done, not retired yet, with the keys of
+// the point commands counted in a table: a key still counted is used by a
+// command that has not finished.
+typedef struct {
+  uint64_t hash;         // of the key, 0 for a free entry
+  uint32_t readers;
+  uint32_t writers;
+} KeyUse;
+
+typedef struct Pending {
+  JobCommand *cmd;
+  struct JobExecutor *executor;
+  int done;
+  int writes;            // WRITE or DELETE
+  size_t num_hashes;     // keys counted in the table
+  uint64_t hashes[MAX_WRITE_SIZE];
+  struct Pending *next;  // in the queue of the workers
+} Pending;
+
+struct JobExecutor {
+  pthread_mutex_t lock;
+  pthread_cond_t finished;            // signaled when a command is done
+  Pending pending[PIPELINE_DEPTH];    // in the order of the job
+  size_t head;                        // oldest pending
+  size_t tail;                        // next to submit
+  KeyUse keys[KEY_SLOTS];
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // signaled when a command is queued, or to stop
+  Pending *first;        // queue of commands waiting for a worker
+  Pending *last;
+  int stopping;
+  pthread_t *workers;
+  size_t num_workers;
+  command_runner run;
+  unsigned long executed; // by the workers
+  unsigned long conflicts; // commands that waited for an earlier one
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, NULL, 0, NULL, 0, 0};
+
+static uint64_t key_hash(const char *key) {
+  uint64_t h = fnv1a(FNV_OFFSET, (const unsigned char *)key, strlen(key));
+  return h == 0 ? 1 : h; // 0 marks free entries
+}
+
+// Finds the entry of a key, or the free one it would take.
+static KeyUse *find_key(JobExecutor *executor, uint64_t hash) {
+  size_t i = hash & (KEY_SLOTS - 1);
+  while (executor->keys[i].hash != 0 && executor->keys[i].hash != hash) {
+    i = (i + 1) & (KEY_SLOTS - 1);
+  }
+  return &executor->keys[i];
+}
+
+static void add_key(JobExecutor *executor, uint64_t hash, int writes) {
+  KeyUse *use = find_key(executor, hash);
+  use->hash = hash;
+  if (writes) {
+    use->writers++;
+  } else {
+    use->readers++;
+  }
+}
+
+// Uncounts a key, freeing its entry once no command uses it. The entries
+// after it move back so that lookups never stop short of theirs.
+static void remove_key(JobExecutor *executor, uint64_t hash, int writes) {
+  KeyUse *use = find_key(executor, hash);
+  if (writes) {
+    use->writers--;
+  } else {
+    use->readers--;
+  }
+  if (use->readers > 0 || use->writers > 0) {
+    return;
+  }
+  size_t i = (size_t)(use - executor->keys);
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & (KEY_SLOTS - 1);
+    if (executor->keys[j].hash == 0) {
+      break;
+    }
+    size_t home = executor->keys[j].hash & (KEY_SLOTS - 1);
+    // stays if its home is cyclically after the hole, up to where it is
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+      continue;
+    }
+    executor->keys[i] = executor->keys[j];
+    i = j;
+  }
+  executor->keys[i] = (KeyUse){0, 0, 0};
+}
+
+static int reads_range(enum Command command) {
+  return command == CMD_SCAN || command == CMD_PREFIX;
+}
+
+// @return Non zero if a SCAN or PREFIX would read the key.
+static int in_range(const JobCommand *range, const char *key) {
+  if (range->command == CMD_PREFIX) {
+    return strncmp(key, range->keys[0], strlen(range->keys[0])) == 0;
+  }
+  return strcmp(key, range->keys[0]) >= 0 && strcmp(key, range->keys[1]) <= 0;
+}
+
+// Checks a command against the pending ones that have not finished. Called
+// with the executor locked.
+// @return Non zero if it has to wait for one of them.
+static int conflicts(JobExecutor *executor, const Pending *p) {
+  const JobCommand *cmd = p->cmd;
+  for (size_t i = 0; i < p->num_hashes; i++) {
+    const KeyUse *use = find_key(executor, p->hashes[i]);
+    if (use->writers > 0 || (p->writes && use->readers > 0)) {
+      return 1;
+    }
+  }
+
+  // ranges are checked against the keys of the commands themselves
+  for (size_t n = executor->head; n != executor->tail; n++) {
+    const Pending *other = &executor->pending[n % PIPELINE_DEPTH];
+    if (other->done) {
+      continue;
+    }
+    const Pending *range = reads_range(cmd->command) ? p : other;
+    const Pending *writer = reads_range(cmd->command) ? other : p;
+    if (range == writer || !reads_range(range->cmd->command) || !writer->writes) {
+      continue;
+    }
+    for (size_t k = 0; k < writer->cmd->num_pairs; k++) {
+      if (in_range(range->cmd, writer->cmd->keys[k])) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Marks a command done, so the commands waiting for it can start and it
+// can be retired.
+static void finish(Pending *p) {
+  JobExecutor *executor = p->executor;
+  pthread_mutex_lock(&executor->lock);
+  for (size_t i = 0; i < p->num_hashes; i++) {
+    remove_key(executor, p->hashes[i], p->writes);
+  }
+  p->done = 1;
+  pthread_cond_broadcast(&executor->finished);
+  pthread_mutex_unlock(&executor->lock);
+}
+
+// Executes queued commands until told to stop.
+static void *job_worker(void *arg) {
+  (void)arg;
+  // signals are left to the main thread, like in the job threads
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    while (pool.first == NULL && !pool.stopping) {
+      pthread_cond_wait(&pool.queued, &pool.lock);
+    }
+    if (pool.first == NULL) {
+      break;
+    }
+    Pending *p = pool.first;
+    pool.first = p->next;
+    if (pool.first == NULL) {
+      pool.last = NULL;
+    }
+    pool.executed++;
+    pthread_mutex_unlock(&pool.lock);
+
+    pool.run(p->cmd);
+    finish(p);
+
+    pthread_mutex_lock(&pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+int executor_init(size_t num_workers, command_runner run) {
+  pool.run = run;
+  if (num_workers == 0) {
+    return 0;
+  }
+  pool.workers = calloc(num_workers, sizeof(pthread_t));
+  if (pool.workers == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    if (pthread_create(&pool.workers[i], NULL, job_worker, NULL) != 0) {
+      executor_stop();
+      return 1;
+    }
+    pool.num_workers++;
+  }
+  return 0;
+}
+
+void executor_stop() {
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = 1;
+  pthread_cond_broadcast(&pool.queued);
+  pthread_mutex_unlock(&pool.lock);
+  for (size_t i = 0; i < pool.num_workers; i++) {
+    pthread_join(pool.workers[i], NULL);
+  }
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.num_workers = 0;
+}
+
+JobExecutor *executor_create() {
+  JobExecutor *executor = calloc(1, sizeof(JobExecutor));
+  if (executor == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&executor->lock, NULL) != 0) {
+    free(executor);
+    return NULL;
+  }
+  if (pthread_cond_init(&executor->finished, NULL) != 0) {
+    pthread_mutex_destroy(&executor->lock);
+    free(executor);
+    return NULL;
+  }
+  return executor;
+}
+
+void executor_destroy(JobExecutor *executor) {
+  pthread_cond_destroy(&executor->finished);
+  pthread_mutex_destroy(&executor->lock);
+  free(executor);
+}
+
+int executor_is_barrier(enum Command command) {
+  switch (command) {
+    case CMD_SHOW:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case EOC:
+      return 1;
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+    case CMD_SCAN:
+    case CMD_PREFIX:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      return 0;
+  }
+  return 1;
+}
+
+void executor_submit(JobExecutor *executor, JobCommand *cmd) {
+  Pending *p = &executor->pending[executor->tail % PIPELINE_DEPTH];
+  p->cmd = cmd;
+  p->executor = executor;
+  p->done = 0;
+  p->writes = cmd->command == CMD_WRITE || cmd->command == CMD_DELETE;
+  p->num_hashes = 0;
+  p->next = NULL;
+
+  int has_keys = cmd->command == CMD_WRITE || cmd->command == CMD_READ ||
+                 cmd->command == CMD_DELETE || reads_range(cmd->command);
+  if (pool.num_workers == 0 || !has_keys) {
+    // only the job's thread reads done, no lock needed
+    pool.run(cmd);
+    p->done = 1;
+    executor->tail++;
+    return;
+  }
+
+  if (!reads_range(cmd->command)) {
+    for (size_t i = 0; i < cmd->num_pairs; i++) {
+      p->hashes[i] = key_hash(cmd->keys[i]);
+    }
+    p->num_hashes = cmd->num_pairs;
+  }
+
+  pthread_mutex_lock(&executor->lock);
+  if (conflicts(executor, p)) {
+    pthread_mutex_lock(&pool.lock);
+    pool.conflicts++;
+    pthread_mutex_unlock(&pool.lock);
+    do {
+      pthread_cond_wait(&executor->finished, &executor->lock);
+    } while (conflicts(executor, p));
+  }
+  for (size_t i = 0; i < p->num_hashes; i++) {
+    add_key(executor, p->hashes[i], p->writes);
+  }
+  executor->tail++;
+  pthread_mutex_unlock(&executor->lock);
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.last == NULL) {
+    pool.first = p;
+  } else {
+    pool.last->next = p;
+  }
+  pool.last = p;
+  pthread_cond_signal(&pool.queued);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+JobCommand *executor_retire(JobExecutor *executor, int wait) {
+  if (executor->head == executor->tail) {
+    return NULL;
+  }
+  Pending *p = &executor->pending[executor->head % PIPELINE_DEPTH];
+  pthread_mutex_lock(&executor->lock);
+  while (!p->done && wait) {
+    pthread_cond_wait(&executor->finished, &executor->lock);
+  }
+  int done = p->done;
+  pthread_mutex_unlock(&executor->lock);
+  if (!done) {
+    return NULL;
+  }
+  executor->head++;
+  return p->cmd;
+}
+
+size_t executor_pending(JobExecutor *executor) {
+  return executor->tail - executor->head;
+}
+
+void executor_report(int fd) {
+  pthread_mutex_lock(&pool.lock);
+  size_t num_workers = pool.num_workers;
+  unsigned long executed = pool.executed;
+  unsigned long waited = pool.conflicts;
+  pthread_mutex_unlock(&pool.lock);
+  if (num_workers == 0) {
+    return;
+  }
+
+  char line[160];
+  snprintf(line, sizeof(line),
+           "Job workers: %zu, %lu commands executed, %lu waited for an earlier one\n",
+           num_workers, executed, waited);
+  write_str(fd, line);
+}
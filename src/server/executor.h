@@ -0,0 +1,71 @@
+#ifndef KVS_EXECUTOR_H
+#define KVS_EXECUTOR_H
+
+#include <stddef.h>
+
+#include "parser.h"
+#include "pipeline.h"
+
+// Executes the commands of a job. Without job workers every command runs on
+// the job's thread, one after the other. With them, WRITE, READ, DELETE,
+// SCAN and PREFIX go to a pool of workers shared by every job, and start
+// while the earlier commands of the job still execute unless they touch a
+// key one of those writes, or write a key one of those touches: then they
+// wait for it. The job's thread retires the commands in the order of the
+// job, writing their output, messages and notifications, so a job's .out
+// is the same as run alone. SHOW, BACKUP and WAIT are barriers: they run on
+// the job's thread once every earlier command is retired.
+
+#define MAX_JOB_WORKERS 256
+
+/// Executes a command into its slot: the failed flag and the output.
+/// Called on a job worker, or on the job's thread.
+typedef void (*command_runner)(JobCommand *cmd);
+
+typedef struct JobExecutor JobExecutor;
+
+/// Starts the job workers, before any job runs.
+/// @param num_workers Number of workers, 0 to run every command on the
+///   thread of its job.
+/// @param run Executes a command.
+/// @return 0 on success, 1 if the workers could not be started.
+int executor_init(size_t num_workers, command_runner run);
+
+/// Stops the job workers, once no job runs.
+void executor_stop();
+
+/// Allocates the state of the commands a job has executing.
+/// @return The executor, NULL if it could not be allocated.
+JobExecutor *executor_create();
+
+/// Frees an executor with no command pending.
+/// @param executor Executor to free.
+void executor_destroy(JobExecutor *executor);
+
+/// @param command Command of a job.
+/// @return Non zero if the command is a barrier, run by the job's thread.
+int executor_is_barrier(enum Command command);
+
+/// Starts a command that is not a barrier, first waiting for the earlier
+/// commands it conflicts with. Without job workers, or when it has no keys,
+/// the command runs right away.
+/// @param executor Executor of the job.
+/// @param cmd Command, kept pending until retired.
+void executor_submit(JobExecutor *executor, JobCommand *cmd);
+
+/// Takes the oldest pending command, once it has executed.
+/// @param executor Executor of the job.
+/// @param wait Non zero to wait for it to execute.
+/// @return The command, NULL if none is pending or, without waiting, it
+///   still executes.
+JobCommand *executor_retire(JobExecutor *executor, int wait);
+
+/// @param executor Executor of the job.
+/// @return Number of commands submitted and not retired yet.
+size_t executor_pending(JobExecutor *executor);
+
+/// Writes the statistics of the job workers, if there are any.
+/// @param fd File descriptor to write to.
+void executor_report(int fd);
+
+#endif  // KVS_EXECUTOR_H
@@ -4,6 +4,10 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "io.h"
+
+#define OUTPUT_KEEP_BYTES 65536 // larger buffers are not kept for the next output
+
 void write_str(int fd, const char *str) {
   size_t len = strlen(str);
   const char *ptr = str;
@@ -21,6 +25,42 @@ void write_str(int fd, const char *str) {
   }
 }
 
+int output_str(OutputBuffer *out, const char *str) {
+  size_t len = strlen(str);
+  if (out->capacity - out->len <= len) {
+    size_t capacity = out->capacity == 0 ? 256 : out->capacity;
+    while (capacity - out->len <= len) {
+      capacity *= 2;
+    }
+    char *data = realloc(out->data, capacity);
+    if (data == NULL) {
+      return 1;
+    }
+    out->data = data;
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->len, str, len + 1);
+  out->len += len;
+  return 0;
+}
+
+void output_flush(OutputBuffer *out, int fd) {
+  if (out->len > 0) {
+    write_str(fd, out->data);
+  }
+  if (out->capacity > OUTPUT_KEEP_BYTES) {
+    output_free(out);
+  }
+  out->len = 0;
+}
+
+void output_free(OutputBuffer *out) {
+  free(out->data);
+  out->data = NULL;
+  out->len = 0;
+  out->capacity = 0;
+}
+
 void write_uint(int fd, int value) {
   char buffer[16];
   size_t i = 16;
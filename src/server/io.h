@@ -3,6 +3,14 @@
 
 #include <unistd.h>
 
+/// Output of a command gathered in memory, to be written out at once when
+/// its turn comes. Zero initialized it is empty.
+typedef struct {
+  char *data;      // null terminated, NULL until something is added
+  size_t len;
+  size_t capacity;
+} OutputBuffer;
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -13,6 +21,22 @@ void write_str(int fd, const char *str);
 /// @param value The value to write.
 void write_uint(int fd, int value);
 
+/// Appends a string to an output buffer, growing it as needed.
+/// @param out The output buffer.
+/// @param str The string to add.
+/// @return 0 on success, 1 if the buffer could not grow.
+int output_str(OutputBuffer *out, const char *str);
+
+/// Writes an output buffer to the given file descriptor and empties it.
+/// A buffer left much larger than usual is freed.
+/// @param out The output buffer.
+/// @param fd The file descriptor to write to.
+void output_flush(OutputBuffer *out, int fd);
+
+/// Frees the memory of an output buffer, which is left empty.
+/// @param out The output buffer.
+void output_free(OutputBuffer *out);
+
 /// @brief Copies bytes from src to dest, not including the '\0'
 /// @param dest 
 /// @param src 
@@ -0,0 +1,478 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "encode.h"
+#include "src/common/io.h"
+#include "src/common/reader.h"
+
+#define DEDUP_SLOTS (2 * MAX_WRITE_SIZE) // power of two, half full at most
+#define FLUSH_BYTES (64 * 1024)          // compiled commands written at a time
+
+// Command codes of the .jobc. They are part of the format, not enum Command,
+// whose order changes as commands are added: a new command takes the next
+// free code, and changing one takes a new JOBC_VERSION.
+enum Opcode {
+  OP_WRITE = 0,
+  OP_READ = 1,
+  OP_DELETE = 2,
+  OP_SHOW = 3,
+  OP_SCAN = 4,
+  OP_PREFIX = 5,
+  OP_WAIT = 6,
+  OP_BACKUP = 7,
+  OP_HELP = 8,
+  OP_INVALID = 10,
+  OP_EOC = 11,
+};
+
+// The command of each code, for the codes check_commands lets through.
+static const enum Command op_commands[OP_EOC + 1] = {
+    [OP_WRITE] = CMD_WRITE,   [OP_READ] = CMD_READ,     [OP_DELETE] = CMD_DELETE,
+    [OP_SHOW] = CMD_SHOW,     [OP_SCAN] = CMD_SCAN,     [OP_PREFIX] = CMD_PREFIX,
+    [OP_WAIT] = CMD_WAIT,     [OP_BACKUP] = CMD_BACKUP, [OP_HELP] = CMD_HELP,
+    [OP_INVALID] = CMD_INVALID, [OP_EOC] = EOC,
+};
+
+// Growing buffer the compiler writes the commands to.
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  int failed;          // out of memory, the rest is dropped
+} Output;
+
+// A loaded job holds the whole .jobc. A job being compiled holds the
+// commands not written to the .jobc yet, and compiles one more each time
+// they have all been decoded. The data is followed by MAX_STRING_SIZE bytes
+// of padding either way, so strings are copied out with a fixed size that
+// compiles to a few moves.
+struct CompiledJob {
+  Output out;          // header and commands, size without the padding
+  size_t pos;          // next command
+  Reader *in;          // text of the job while compiling, NULL after
+  int job_fd;
+  int save_fd;         // .jobc being written, -1 if it is not
+  char path[PATH_MAX]; // of the .jobc
+};
+
+static unsigned char *reserve(Output *out, size_t bytes) {
+  if (out->failed) {
+    return NULL;
+  }
+  if (out->size + bytes > out->capacity) {
+    size_t capacity = out->capacity == 0 ? 4096 : out->capacity;
+    while (capacity < out->size + bytes) {
+      capacity *= 2;
+    }
+    unsigned char *grown = realloc(out->data, capacity);
+    if (grown == NULL) {
+      out->failed = 1;
+      return NULL;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+  }
+  unsigned char *p = out->data + out->size;
+  out->size += bytes;
+  return p;
+}
+
+static void put_byte(Output *out, unsigned char value) {
+  unsigned char *p = reserve(out, 1);
+  if (p != NULL) {
+    *p = value;
+  }
+}
+
+static void put_string(Output *out, const char *str) {
+  size_t len = strlen(str);
+  unsigned char *p = reserve(out, 1 + len);
+  if (p != NULL) {
+    p[0] = (unsigned char)len;
+    memcpy(p + 1, str, len);
+  }
+}
+
+static void put_count(Output *out, size_t count) {
+  unsigned char *p = reserve(out, 2);
+  if (p != NULL) {
+    put_u16(p, (uint16_t)count);
+  }
+}
+
+// Keeps the last write of every key of a WRITE list: the list is applied as
+// one batch, so no reader can see the values written before it. Walks the
+// list backwards through a small open addressing table of the keys seen.
+// @return Number of pairs kept, in their order.
+static size_t drop_overwritten(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                               char values[][MAX_STRING_SIZE]) {
+  size_t seen[DEDUP_SLOTS]; // index + 1 of a later pair, 0 if free
+  unsigned char overwritten[MAX_WRITE_SIZE] = {0};
+  memset(seen, 0, sizeof(seen));
+  for (size_t i = num_pairs; i-- > 0;) {
+    size_t slot = fnv1a(FNV_OFFSET, (const unsigned char *)keys[i], strlen(keys[i])) &
+                  (DEDUP_SLOTS - 1);
+    while (seen[slot] != 0 && strcmp(keys[seen[slot] - 1], keys[i]) != 0) {
+      slot = (slot + 1) & (DEDUP_SLOTS - 1);
+    }
+    if (seen[slot] != 0) {
+      overwritten[i] = 1;
+    } else {
+      seen[slot] = i + 1;
+    }
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (!overwritten[i]) {
+      if (kept != i) {
+        strcpy(keys[kept], keys[i]);
+        strcpy(values[kept], values[i]);
+      }
+      kept++;
+    }
+  }
+  return kept;
+}
+
+// Parses the next command of a job into out, with the same grammar as
+// running it. Adds nothing for the commands that are dropped.
+static void compile_next(Reader *in, Output *out) {
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  enum Command command = get_next(in);
+  size_t num_pairs;
+  unsigned int delay;
+  switch (command) {
+    case CMD_WRITE:
+      num_pairs = parse_write(in, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      if (num_pairs == 0) {
+        put_byte(out, OP_INVALID);
+        break;
+      }
+      num_pairs = drop_overwritten(num_pairs, keys, values);
+      put_byte(out, OP_WRITE);
+      put_count(out, num_pairs);
+      for (size_t i = 0; i < num_pairs; i++) {
+        put_string(out, keys[i]);
+        put_string(out, values[i]);
+      }
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      if (num_pairs == 0) {
+        put_byte(out, OP_INVALID);
+        break;
+      }
+      put_byte(out, command == CMD_READ ? OP_READ : OP_DELETE);
+      put_count(out, num_pairs);
+      for (size_t i = 0; i < num_pairs; i++) {
+        put_string(out, keys[i]);
+      }
+      break;
+
+    case CMD_SCAN:
+    case CMD_PREFIX:
+      num_pairs = command == CMD_SCAN ? 2 : 1;
+      if (parse_range(in, keys, num_pairs) != 0) {
+        put_byte(out, OP_INVALID);
+        break;
+      }
+      put_byte(out, command == CMD_SCAN ? OP_SCAN : OP_PREFIX);
+      for (size_t i = 0; i < num_pairs; i++) {
+        put_string(out, keys[i]);
+      }
+      break;
+
+    case CMD_WAIT:
+      if (parse_wait(in, &delay, NULL) == -1) {
+        put_byte(out, OP_INVALID);
+      } else if (delay > 0) {
+        put_byte(out, OP_WAIT);
+        unsigned char *p = reserve(out, 4);
+        if (p != NULL) {
+          put_u32(p, delay);
+        }
+      }
+      break;
+
+    case CMD_SHOW:
+      put_byte(out, OP_SHOW);
+      break;
+
+    case CMD_BACKUP:
+      put_byte(out, OP_BACKUP);
+      break;
+
+    case CMD_HELP:
+      put_byte(out, OP_HELP);
+      break;
+
+    case CMD_INVALID:
+      put_byte(out, OP_INVALID);
+      break;
+
+    case CMD_EMPTY:
+      break;
+
+    case EOC:
+      put_byte(out, OP_EOC);
+      break;
+  }
+}
+
+// Checks that the commands after the header decode within the buffer, up
+// to an EOC that ends it.
+// @return 1 if they do, 0 otherwise.
+static int check_commands(const unsigned char *data, size_t size) {
+  size_t pos = JOBC_HEADER_SIZE;
+  while (pos < size) {
+    enum Opcode op = data[pos++];
+    size_t count = 0;
+    size_t strings_per_key = 1;
+    switch (op) {
+      case OP_WRITE:
+        strings_per_key = 2;
+        // fall through
+      case OP_READ:
+      case OP_DELETE:
+        if (size - pos < 2) {
+          return 0;
+        }
+        count = get_u16(data + pos);
+        pos += 2;
+        if (count == 0 || count >= MAX_WRITE_SIZE) {
+          return 0;
+        }
+        count *= strings_per_key;
+        break;
+      case OP_SCAN:
+        count = 2;
+        break;
+      case OP_PREFIX:
+        count = 1;
+        break;
+      case OP_WAIT:
+        if (size - pos < 4) {
+          return 0;
+        }
+        pos += 4;
+        break;
+      case OP_SHOW:
+      case OP_BACKUP:
+      case OP_HELP:
+      case OP_INVALID:
+        break;
+      case OP_EOC:
+        return pos == size;
+      default:
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (pos >= size || data[pos] >= MAX_STRING_SIZE || size - pos - 1 < data[pos]) {
+        return 0;
+      }
+      pos += 1 + data[pos];
+    }
+  }
+  return 0;
+}
+
+static void put_header(unsigned char *header, const struct stat *st) {
+  memcpy(header, JOBC_MAGIC, 8); // with its null terminator
+  put_u32(header + 8, JOBC_VERSION);
+  put_u32(header + 12, (uint32_t)st->st_mtim.tv_nsec);
+  put_u64(header + 16, (uint64_t)st->st_mtim.tv_sec);
+  put_u64(header + 24, (uint64_t)st->st_size);
+}
+
+// Loads the .jobc of a job, if it was compiled from the job as it is now.
+// @return 1 if it was loaded, 0 if there is none or it does not check out.
+static int load(CompiledJob *job, const struct stat *job_st) {
+  int fd = open(job->path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  int loaded = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > JOBC_HEADER_SIZE) {
+    size_t size = (size_t)st.st_size;
+    unsigned char *data = malloc(size + MAX_STRING_SIZE);
+    unsigned char expected[JOBC_HEADER_SIZE];
+    if (data != NULL && read_all(fd, data, size, NULL) == 1) {
+      put_header(expected, job_st);
+      loaded = memcmp(data, expected, JOBC_HEADER_SIZE) == 0 && check_commands(data, size);
+    }
+    if (loaded) {
+      job->out = (Output){data, size, size + MAX_STRING_SIZE, 0};
+    } else {
+      free(data);
+    }
+  }
+  close(fd);
+  return loaded;
+}
+
+// Writes the commands decoded so far to the .jobc being written, and drops
+// them. Failing to write only means the job is compiled again next time.
+static void flush(CompiledJob *job) {
+  if (job->save_fd >= 0 && write_all(job->save_fd, job->out.data, job->out.size) != 1) {
+    close(job->save_fd);
+    job->save_fd = -1;
+  }
+  job->out.size = 0;
+  job->pos = 0;
+}
+
+// Ends compiling: the .jobc written aside is renamed into place, so a .jobc
+// is always whole.
+// @param complete Non zero if the whole job was compiled and written.
+static void end_compile(CompiledJob *job, int complete) {
+  if (job->save_fd >= 0) {
+    char tmp_path[PATH_MAX + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    int failed = close(job->save_fd) != 0 || !complete;
+    if (failed || rename(tmp_path, job->path) != 0) {
+      unlink(tmp_path);
+    }
+    job->save_fd = -1;
+  }
+  free(job->in);
+  job->in = NULL;
+  if (job->job_fd >= 0) {
+    close(job->job_fd);
+    job->job_fd = -1;
+  }
+}
+
+CompiledJob *jobc_open(const char *job_path) {
+  CompiledJob *job = malloc(sizeof(CompiledJob));
+  if (job == NULL) {
+    return NULL;
+  }
+  *job = (CompiledJob){{NULL, 0, 0, 0}, JOBC_HEADER_SIZE, NULL, -1, -1, {0}};
+  // a job whose .jobc path does not fit is only compiled in memory
+  int cached = snprintf(job->path, sizeof(job->path), "%sc", job_path) < (int)sizeof(job->path);
+  job->job_fd = open(job_path, O_RDONLY);
+  struct stat st;
+  if (job->job_fd < 0 || fstat(job->job_fd, &st) != 0) {
+    jobc_close(job);
+    return NULL;
+  }
+
+  if (cached && load(job, &st)) {
+    close(job->job_fd);
+    job->job_fd = -1;
+    return job;
+  }
+
+  job->in = malloc(sizeof(Reader));
+  if (job->in == NULL || reserve(&job->out, JOBC_HEADER_SIZE + MAX_STRING_SIZE) == NULL) {
+    jobc_close(job);
+    return NULL;
+  }
+  reader_init(job->in, job->job_fd);
+  job->out.size = JOBC_HEADER_SIZE;
+  // the header keeps the stat taken before parsing, a job edited meanwhile
+  // is compiled again next time
+  put_header(job->out.data, &st);
+  if (cached) {
+    char tmp_path[PATH_MAX + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    job->save_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  return job;
+}
+
+// Compiles commands until there is one to decode.
+// @return 1 if there is, 0 if the compiler ran out of memory.
+static int compile_more(CompiledJob *job) {
+  if (job->out.size >= FLUSH_BYTES) {
+    flush(job);
+  }
+  while (job->pos == job->out.size && !job->out.failed) {
+    compile_next(job->in, &job->out);
+    // padding, not part of the size
+    if (reserve(&job->out, MAX_STRING_SIZE) != NULL) {
+      job->out.size -= MAX_STRING_SIZE;
+    }
+  }
+  return !job->out.failed;
+}
+
+static void get_string(CompiledJob *job, char *str) {
+  size_t len = job->out.data[job->pos];
+  memcpy(str, job->out.data + job->pos + 1, MAX_STRING_SIZE);
+  str[len] = '\0';
+  job->pos += 1 + len;
+}
+
+enum Command jobc_next(CompiledJob *job, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE], size_t *num_pairs, unsigned int *delay) {
+  if (job->in != NULL && job->pos == job->out.size && !compile_more(job)) {
+    fprintf(stderr, "Failed to compile job, out of memory\n");
+    end_compile(job, 0);
+    job->out.size = job->pos;
+  }
+  if (job->pos == job->out.size) {
+    return EOC; // ended, nothing kept
+  }
+
+  // the stream was checked when loaded or made by the compiler
+  enum Command command = op_commands[job->out.data[job->pos++]];
+  switch (command) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+      *num_pairs = get_u16(job->out.data + job->pos);
+      job->pos += 2;
+      for (size_t i = 0; i < *num_pairs; i++) {
+        get_string(job, keys[i]);
+        if (command == CMD_WRITE) {
+          get_string(job, values[i]);
+        }
+      }
+      break;
+    case CMD_SCAN:
+    case CMD_PREFIX:
+      *num_pairs = command == CMD_SCAN ? 2 : 1;
+      for (size_t i = 0; i < *num_pairs; i++) {
+        get_string(job, keys[i]);
+      }
+      break;
+    case CMD_WAIT:
+      *delay = get_u32(job->out.data + job->pos);
+      job->pos += 4;
+      break;
+    case EOC:
+      if (job->in != NULL) {
+        flush(job);
+        end_compile(job, job->save_fd >= 0);
+      } else {
+        job->pos--; // stays at the end
+      }
+      break;
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      break;
+  }
+  return command;
+}
+
+void jobc_close(CompiledJob *job) {
+  end_compile(job, 0);
+  free(job->out.data);
+  free(job);
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+
+// Compiled jobs: a .job is parsed once into a .jobc next to it, a stream of
+// commands already split into keys and values, and later runs read that
+// instead of the text. The first run compiles the commands as they are
+// asked for and writes the .jobc along the way. The .jobc remembers the
+// modification time and size of the .job it came from and is compiled again
+// when they change, or when its commands do not decode. Key hashes are not
+// stored: the shards seed theirs anew on every run.
+//
+// Layout, integers little endian:
+//   header:  8-byte magic "KVSJOBC\0", u32 format version, u32 nanoseconds
+//            and u64 seconds of the .job's mtime, u64 size of the .job
+//   command: u8 code (enum Opcode in jobc.c), then
+//            WRITE                 u16 count, count (key, value) strings
+//            READ, DELETE          u16 count, count key strings
+//            SCAN, PREFIX          2 or 1 key strings
+//            WAIT                  u32 delay in ms
+//            SHOW, BACKUP, HELP,   nothing
+//            INVALID
+//   string:  u8 length, the bytes
+// The stream ends with EOC. Empty lines, comments and WAIT 0 are dropped,
+// and so is a write of a WRITE list whose key the same list writes again.
+
+#define JOBC_MAGIC "KVSJOBC"
+#define JOBC_VERSION 1
+#define JOBC_HEADER_SIZE 32
+
+typedef struct CompiledJob CompiledJob;
+
+/// Opens the compiled form of a job. If its .jobc is missing, stale or
+/// damaged, the job is compiled as its commands are decoded instead, and
+/// the .jobc is only replaced once the whole job was. The commands still
+/// come when the .jobc can not be written.
+/// @param job_path Path of the .job file.
+/// @return The compiled job, NULL if the job can not be read.
+CompiledJob *jobc_open(const char *job_path);
+
+/// Decodes the next command.
+/// @param job Compiled job.
+/// @param keys Filled with the keys of WRITE, READ, DELETE, SCAN and PREFIX.
+/// @param values Filled with the values of WRITE.
+/// @param num_pairs Set to the number of keys.
+/// @param delay Set to the delay of WAIT.
+/// @return The command, EOC after the last one.
+enum Command jobc_next(CompiledJob *job, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE], size_t *num_pairs, unsigned int *delay);
+
+/// Frees a compiled job. A .jobc left half written is dropped.
+/// @param job Compiled job.
+void jobc_close(CompiledJob *job);
+
+#endif  // KVS_JOBC_H
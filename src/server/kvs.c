@@ -1,136 +1,564 @@
 #include "kvs.h"
 #include "string.h"
-#include <ctype.h>
+#include "epoch.h"
+#include "storage.h"
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <stdlib.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+// Final mixing step of MurmurHash3, spreads every input bit over the output.
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Seeded FNV-1a over the key bytes followed by a 64 bit finalizer, so that
+// keys sharing a prefix still land in unrelated buckets.
+uint64_t hash(uint64_t seed, const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < MAX_STRING_SIZE - 1 && key[i] != '\0'; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+uint64_t new_hash_seed() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seed = (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32);
+    seed ^= (uint64_t)getpid() << 16;
+    seed ^= (uint64_t)(uintptr_t)&ts;
+    return mix64(seed);
+}
+
+static BucketArray *create_bucket_array(size_t size) {
+    BucketArray *array = malloc(sizeof(BucketArray) + size * sizeof(_Atomic(KeyNode *)));
+    if (array == NULL) return NULL;
+    array->size = size;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&array->buckets[i], NULL);
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    return array;
 }
 
 struct HashTable* create_hash_table() {
-	HashTable *ht = malloc(sizeof(HashTable));
+	HashTable *ht = aligned_alloc(_Alignof(HashTable), sizeof(HashTable));
 	if (!ht) return NULL;
-	for (int i = 0; i < TABLE_SIZE; i++) {
-		ht->table[i] = NULL;
+	BucketArray *table = create_bucket_array(INITIAL_TABLE_SIZE);
+	if (!table) {
+		free(ht);
+		return NULL;
 	}
-	pthread_rwlock_init(&ht->tablelock, NULL);
+	ht->nodes = slab_create("KeyNode", sizeof(KeyNode), _Alignof(KeyNode));
+	ht->towers = slab_create("SkipTower", (SKIP_LEVELS - 1) * sizeof(_Atomic(KeyNode *)),
+	                         _Alignof(_Atomic(KeyNode *)));
+	ht->values = slab_create("Version", offsetof(Version, value) + storage_slot_size(),
+	                         _Alignof(Version));
+	if (!ht->nodes || !ht->towers || !ht->values) {
+		if (ht->nodes) slab_destroy(ht->nodes);
+		if (ht->towers) slab_destroy(ht->towers);
+		if (ht->values) slab_destroy(ht->values);
+		free(table);
+		free(ht);
+		return NULL;
+	}
+	ht->rng = new_hash_seed() | 1;
+	for (int level = 0; level < SKIP_LEVELS; level++) {
+		atomic_init(&ht->head[level], NULL);
+	}
+	atomic_init(&ht->table[0], table);
+	atomic_init(&ht->table[1], NULL);
+	atomic_init(&ht->rehash_index, 0);
+	ht->count = 0;
+	ht->queue = NULL;
+	ht->queue_first = 0;
+	ht->queue_count = 0;
+	ht->queue_capacity = 0;
+	ht->queue_added = 0;
+	pthread_rwlock_init(&ht->lock, NULL);
+	atomic_init(&ht->seq, 0);
 	return ht;
 }
 
-int find_key(HashTable *ht, const char *key) {
-    int index = hash(key);
+void lock_table(HashTable *ht, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&ht->lock);
+    } else {
+        pthread_rwlock_rdlock(&ht->lock);
+    }
+}
 
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
+int try_lock_table(HashTable *ht) {
+    return pthread_rwlock_trywrlock(&ht->lock) == 0;
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            return 1;
+void unlock_table(HashTable *ht, int exclusive) {
+    (void)exclusive;
+    pthread_rwlock_unlock(&ht->lock);
+}
+
+// Bumps the sequence around a change that moves nodes between chains.
+static void begin_move(HashTable *ht) {
+    unsigned seq = atomic_load_explicit(&ht->seq, memory_order_relaxed);
+    atomic_store_explicit(&ht->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void end_move(HashTable *ht) {
+    unsigned seq = atomic_load_explicit(&ht->seq, memory_order_relaxed);
+    atomic_store_explicit(&ht->seq, seq + 1, memory_order_release);
+}
+
+int read_begin(HashTable *ht, unsigned *seq) {
+    *seq = atomic_load_explicit(&ht->seq, memory_order_acquire);
+    return !(*seq & 1);
+}
+
+int read_validate(HashTable *ht, unsigned seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ht->seq, memory_order_relaxed) == seq;
+}
+
+// Publishes a new version of a key in front of the older ones. The value is
+// cut at MAX_STRING_SIZE - 1 characters.
+// @return 0 if successful, 1 if out of memory or storage.
+static int push_version(HashTable *ht, KeyNode *keyNode, const char *value, uint64_t version) {
+    Version *newest = slab_alloc(ht->values);
+    if (newest == NULL) return 1;
+    size_t len = value == NULL ? 0 : strnlen(value, MAX_STRING_SIZE - 1);
+    if (storage_put(keyNode->key, value == NULL ? "" : value, len, newest->value) != 0) {
+        slab_free(newest);
+        return 1;
+    }
+    newest->len = (unsigned char)len;
+    newest->deleted = value == NULL;
+    newest->version = version;
+    atomic_init(&newest->older, atomic_load_explicit(&keyNode->versions, memory_order_relaxed));
+    atomic_store_explicit(&keyNode->versions, newest, memory_order_release);
+    return 0;
+}
+
+// Queues a node written by the current batch for collect_versions.
+static void queue_node(HashTable *ht, KeyNode *keyNode) {
+    if (keyNode->queued) return;
+    if (ht->queue_count == ht->queue_capacity) {
+        size_t capacity = ht->queue_capacity == 0 ? 64 : ht->queue_capacity * 2;
+        KeyNode **queue = malloc(capacity * sizeof(KeyNode *));
+        if (queue == NULL) return; // its old versions stay until the next write
+        for (size_t i = 0; i < ht->queue_count; i++) {
+            queue[i] = ht->queue[(ht->queue_first + i) % ht->queue_capacity];
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next;
+        free(ht->queue);
+        ht->queue = queue;
+        ht->queue_first = 0;
+        ht->queue_capacity = capacity;
+    }
+    ht->queue[(ht->queue_first + ht->queue_count++) % ht->queue_capacity] = keyNode;
+    keyNode->queued = 1;
+    ht->queue_added++;
+}
+
+const Version *version_at(KeyNode *node, uint64_t snapshot) {
+    Version *v = atomic_load_explicit(&node->versions, memory_order_acquire);
+    while (v != NULL && v->version > snapshot) {
+        v = atomic_load_explicit(&v->older, memory_order_acquire);
     }
+    return v == NULL || v->deleted ? NULL : v;
+}
 
-    return 0;
+const char *version_value(const Version *v) {
+    return storage_get(v->value, v->len);
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+// Returns the head of the chain a hash belongs to, looking at the new array
+// for buckets that were already migrated.
+// Lock free readers may get a stale chain, which read_validate catches.
+static _Atomic(KeyNode *) *bucket_of(HashTable *ht, uint64_t h) {
+    BucketArray *table = atomic_load_explicit(&ht->table[0], memory_order_acquire);
+    BucketArray *next = atomic_load_explicit(&ht->table[1], memory_order_acquire);
+    size_t index = h & (table->size - 1);
+    if (next != NULL &&
+        index < atomic_load_explicit(&ht->rehash_index, memory_order_relaxed)) {
+        return &next->buckets[h & (next->size - 1)];
+    }
+    return &table->buckets[index];
+}
 
-    // Search for the key node
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
+// Link of a node, or of the sentinel when node is NULL, at a skip list level.
+static _Atomic(KeyNode *) *forward(HashTable *ht, KeyNode *node, int level) {
+    if (node == NULL) {
+        return &ht->head[level];
+    }
+    return level == 0 ? &node->ordered : &node->tower[level - 1];
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // overwrite value
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
+// Walks down the skip list to the last node of each level whose key is
+// smaller than key, filling preds when given.
+// @return The first node whose key is not smaller than key.
+static KeyNode *descend(HashTable *ht, const char *key, KeyNode **preds) {
+    KeyNode *pred = NULL;
+    KeyNode *next = NULL;
+    for (int level = SKIP_LEVELS - 1; level >= 0; level--) {
+        next = atomic_load_explicit(forward(ht, pred, level), memory_order_acquire);
+        while (next != NULL && strncmp(next->key, key, MAX_STRING_SIZE - 1) < 0) {
+            pred = next;
+            next = atomic_load_explicit(forward(ht, pred, level), memory_order_acquire);
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
-    }
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
-    return 0;
+        if (preds != NULL) {
+            preds[level] = pred;
+        }
+    }
+    return next;
+}
+
+// Height of a new node: each level is kept with probability 1/4.
+static unsigned char random_height(HashTable *ht) {
+    // xorshift64*, only used with the table write locked
+    ht->rng ^= ht->rng >> 12;
+    ht->rng ^= ht->rng << 25;
+    ht->rng ^= ht->rng >> 27;
+    uint64_t bits = ht->rng * 0x2545f4914f6cdd1dULL;
+    unsigned char height = 1;
+    while (height < SKIP_LEVELS && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+    return height;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+// Links a new node in the skip list, lowest level first.
+static void link_ordered(HashTable *ht, KeyNode *keyNode) {
+    KeyNode *preds[SKIP_LEVELS];
+    descend(ht, keyNode->key, preds);
+    for (int level = 0; level < keyNode->height; level++) {
+        _Atomic(KeyNode *) *link = forward(ht, preds[level], level);
+        atomic_store_explicit(forward(ht, keyNode, level),
+                              atomic_load_explicit(link, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(link, keyNode, memory_order_release);
+    }
+}
 
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-    char *value;
+// Bypasses a node at every level of the skip list. Like in the hash chains,
+// its own links are kept so that readers standing on it can move on.
+static void unlink_ordered(HashTable *ht, KeyNode *keyNode) {
+    KeyNode *preds[SKIP_LEVELS];
+    descend(ht, keyNode->key, preds);
+    for (int level = keyNode->height - 1; level >= 0; level--) {
+        atomic_store_explicit(forward(ht, preds[level], level),
+                              atomic_load_explicit(forward(ht, keyNode, level), memory_order_relaxed),
+                              memory_order_release);
+    }
+}
 
+static KeyNode *find_node(HashTable *ht, const char *key, uint64_t h) {
+    KeyNode *keyNode = atomic_load_explicit(bucket_of(ht, h), memory_order_acquire);
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return the value if found
+        if (keyNode->hash == h && strncmp(keyNode->key, key, MAX_STRING_SIZE - 1) == 0) {
+            return keyNode;
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
     }
+    return NULL;
+}
+
+// Swaps the new array in once every bucket was migrated.
+static void finish_resize(HashTable *ht) {
+    BucketArray *old = atomic_load_explicit(&ht->table[0], memory_order_relaxed);
+    BucketArray *table = atomic_load_explicit(&ht->table[1], memory_order_relaxed);
+    atomic_store_explicit(&ht->table[0], table, memory_order_release);
+    atomic_store_explicit(&ht->table[1], NULL, memory_order_release);
+    atomic_store_explicit(&ht->rehash_index, 0, memory_order_relaxed);
+    epoch_retire(old, free); // lock free readers may still be walking it
+}
 
-    return NULL; // Key not found
+// Starts a resize when the load factor gets too high. The new array is only
+// allocated here, entries are moved later by resize_step.
+static void maybe_grow(HashTable *ht) {
+    BucketArray *table = atomic_load_explicit(&ht->table[0], memory_order_relaxed);
+    if (atomic_load_explicit(&ht->table[1], memory_order_relaxed) != NULL ||
+        ht->count <= table->size * MAX_LOAD_FACTOR) {
+        return;
+    }
+    BucketArray *next = create_bucket_array(table->size * 2);
+    if (next == NULL) {
+        return; // keep working with longer chains
+    }
+    atomic_store_explicit(&ht->table[1], next, memory_order_release);
+    atomic_store_explicit(&ht->rehash_index, 0, memory_order_relaxed);
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+void resize_step(HashTable *ht, size_t num_writes) {
+    maybe_grow(ht);
 
-    // Search for the key node
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    BucketArray *table = atomic_load_explicit(&ht->table[0], memory_order_relaxed);
+    BucketArray *next = atomic_load_explicit(&ht->table[1], memory_order_relaxed);
+    if (next == NULL) {
+        return;
+    }
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+    // nodes are relinked, not copied: a reader following them ends up in
+    // the wrong chain, but the table's sequence makes it retry
+    begin_move(ht);
+    size_t steps = REHASH_STEP * (num_writes > 0 ? num_writes : 1);
+    size_t empty_visits = steps * 10; // bound the work done on sparse tables
+    while (steps > 0 && empty_visits > 0) {
+        size_t index = atomic_load_explicit(&ht->rehash_index, memory_order_relaxed);
+        if (index == table->size) {
+            finish_resize(ht);
+            break;
+        }
+
+        KeyNode *keyNode = atomic_load_explicit(&table->buckets[index], memory_order_relaxed);
+        if (keyNode == NULL) {
+            empty_visits--;
+        } else {
+            steps--;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        while (keyNode != NULL) {
+            KeyNode *nextNode = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
+            _Atomic(KeyNode *) *head = &next->buckets[keyNode->hash & (next->size - 1)];
+            atomic_store_explicit(&keyNode->next,
+                                  atomic_load_explicit(head, memory_order_relaxed),
+                                  memory_order_relaxed);
+            atomic_store_explicit(head, keyNode, memory_order_release);
+            keyNode = nextNode;
+        }
+        atomic_store_explicit(&table->buckets[index], NULL, memory_order_relaxed);
+        atomic_store_explicit(&ht->rehash_index, index + 1, memory_order_relaxed);
+    }
+    end_move(ht);
+}
+
+int find_key(HashTable *ht, uint64_t h, const char *key, uint64_t snapshot) {
+    KeyNode *keyNode = find_node(ht, key, h);
+    return keyNode != NULL && version_at(keyNode, snapshot) != NULL;
+}
+
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value, uint64_t version) {
+    // Search for the key node, a deleted key gets its node back
+    KeyNode *keyNode = find_node(ht, key, h);
+    if (keyNode != NULL) {
+        if (push_version(ht, keyNode, value, version) != 0) return 1;
+        queue_node(ht, keyNode);
+        return 0;
+    }
+    // Key not found, create a new key node and its first version
+    keyNode = slab_alloc(ht->nodes);
+    if (keyNode == NULL) return 1;
+    size_t key_len = strnlen(key, MAX_STRING_SIZE - 1);
+    memcpy(keyNode->key, key, key_len);
+    keyNode->key[key_len] = '\0';
+    keyNode->key_len = (unsigned char)key_len;
+    atomic_init(&keyNode->versions, NULL);
+    if (push_version(ht, keyNode, value, version) != 0) {
+        slab_free(keyNode);
+        return 1;
+    }
+    keyNode->hash = h;
+    keyNode->queued = 0;
+    keyNode->height = random_height(ht);
+    keyNode->tower = NULL;
+    if (keyNode->height > 1) {
+        keyNode->tower = slab_alloc(ht->towers);
+        if (keyNode->tower == NULL) keyNode->height = 1; // still reachable, only slower
+    }
+    link_ordered(ht, keyNode);
+    _Atomic(KeyNode *) *head = bucket_of(ht, h);
+    atomic_init(&keyNode->next, atomic_load_explicit(head, memory_order_relaxed)); // Link to existing nodes
+    atomic_store_explicit(head, keyNode, memory_order_release); // Publish it at the start of the list
+    ht->count++;
+    return 0;
+}
+
+int read_pair(HashTable *ht, uint64_t h, const char *key, uint64_t snapshot,
+              const char **value, int *len) {
+    KeyNode *keyNode = find_node(ht, key, h);
+    const Version *v = keyNode == NULL ? NULL : version_at(keyNode, snapshot);
+    if (v == NULL) {
+        return 1; // Key not found
+    }
+    *value = version_value(v);
+    *len = v->len;
+    return 0;
+}
+
+int delete_pair(HashTable *ht, uint64_t h, const char *key, uint64_t version) {
+    KeyNode *keyNode = find_node(ht, key, h);
+    if (keyNode == NULL || version_at(keyNode, version) == NULL) {
+        return 1;
+    }
+    // snapshots older than the delete still read the value, the node is
+    // removed by collect_versions
+    if (push_version(ht, keyNode, NULL, version) != 0) return 1;
+    queue_node(ht, keyNode);
+    return 0;
+}
+
+// Retire function of versions, their value goes with them.
+static void free_version(void *ptr) {
+    Version *v = ptr;
+    storage_release(v->value, v->len);
+    slab_free(v);
+}
+
+// Frees a chain of versions once no reader can reach it.
+static void retire_versions(Version *v) {
+    while (v != NULL) {
+        Version *older = atomic_load_explicit(&v->older, memory_order_relaxed);
+        epoch_retire(v, free_version);
+        v = older;
     }
+}
+
+// Removes the node of a deleted key from the chains and the skip list.
+static void remove_node(HashTable *ht, KeyNode *keyNode) {
+    _Atomic(KeyNode *) *link = bucket_of(ht, keyNode->hash);
+    while (atomic_load_explicit(link, memory_order_relaxed) != keyNode) {
+        link = &atomic_load_explicit(link, memory_order_relaxed)->next;
+    }
+    // bypass it, readers already on it can still move on
+    atomic_store_explicit(link, atomic_load_explicit(&keyNode->next, memory_order_relaxed),
+                          memory_order_release);
+    unlink_ordered(ht, keyNode);
+    // Free the node once no reader can reach it
+    retire_versions(atomic_load_explicit(&keyNode->versions, memory_order_relaxed));
+    epoch_retire(keyNode->tower, slab_free);
+    epoch_retire(keyNode, slab_free);
+    ht->count--;
+}
+
+void collect_versions(HashTable *ht, uint64_t horizon) {
+    // at least as many nodes as were queued, so that the queue can not grow
+    // while no snapshot holds old versions
+    size_t budget = ht->queue_added + COLLECT_STEP;
+    ht->queue_added = 0;
+    for (; budget > 0 && ht->queue_count > 0; budget--) {
+        KeyNode *keyNode = ht->queue[ht->queue_first];
+        ht->queue_first = (ht->queue_first + 1) % ht->queue_capacity;
+        ht->queue_count--;
 
+        Version *newest = atomic_load_explicit(&keyNode->versions, memory_order_relaxed);
+        if (newest->version > horizon) {
+            // a snapshot may still need an older version, look again later
+            ht->queue[(ht->queue_first + ht->queue_count++) % ht->queue_capacity] = keyNode;
+            continue;
+        }
+        keyNode->queued = 0;
+        if (newest->deleted) {
+            remove_node(ht, keyNode);
+            continue;
+        }
+        // every snapshot reads the newest version, the older ones can go
+        Version *older = atomic_load_explicit(&newest->older, memory_order_relaxed);
+        atomic_store_explicit(&newest->older, NULL, memory_order_release);
+        retire_versions(older);
+    }
+}
+
+int relocate_value(HashTable *ht, uint64_t h, const char *key, const void *slot) {
+    KeyNode *keyNode = find_node(ht, key, h);
+    if (keyNode == NULL) return 0;
+    size_t slot_size = storage_slot_size();
+    _Atomic(Version *) *link = &keyNode->versions;
+    Version *v;
+    while ((v = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+        if (v->len > 0 && memcmp(v->value, slot, slot_size) == 0) {
+            break;
+        }
+        link = &v->older;
+    }
+    if (v == NULL) return 0;
+
+    // the copy takes the place of the version in the chain, readers on the
+    // old one still read the old segment until they leave their epoch
+    Version *moved = slab_alloc(ht->values);
+    if (moved == NULL) return 0;
+    if (storage_put(keyNode->key, version_value(v), v->len, moved->value) != 0) {
+        slab_free(moved);
+        return 0;
+    }
+    moved->version = v->version;
+    moved->len = v->len;
+    moved->deleted = v->deleted;
+    atomic_init(&moved->older, atomic_load_explicit(&v->older, memory_order_relaxed));
+    atomic_store_explicit(link, moved, memory_order_release);
+    epoch_retire(v, free_version);
     return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+KeyNode *seek_pair(HashTable *ht, const char *from) {
+    if (from == NULL) {
+        return atomic_load_explicit(&ht->head[0], memory_order_acquire);
+    }
+    return descend(ht, from, NULL);
+}
+
+KeyNode *next_pair(KeyNode *node) {
+    return atomic_load_explicit(&node->ordered, memory_order_acquire);
+}
+
+size_t split_keys(HashTable *ht, size_t parts, char splits[][MAX_STRING_SIZE]) {
+    // each level holds about a quarter of the level below, spread evenly over
+    // the keys, so the highest level with a few dozen nodes per part is a sample
+    // that only costs a walk over those nodes
+    size_t wanted = parts * 32;
+    int level = SKIP_LEVELS - 1;
+    size_t count = 0;
+    for (; level >= 0; level--) {
+        count = 0;
+        KeyNode *node = atomic_load_explicit(&ht->head[level], memory_order_acquire);
+        while (node != NULL) {
+            count++;
+            node = atomic_load_explicit(forward(ht, node, level), memory_order_acquire);
+        }
+        if (count >= wanted) {
+            break;
+        }
+    }
+    if (level < 0) {
+        level = 0; // the whole table has fewer keys, the last count is exact
+    }
+
+    // the sample may have changed since it was counted, a few keys off only
+    // makes the parts a little uneven
+    size_t num_splits = 0;
+    size_t index = 0;
+    KeyNode *node = atomic_load_explicit(&ht->head[level], memory_order_acquire);
+    for (size_t part = 1; part < parts && node != NULL; part++) {
+        size_t target = part * count / parts;
+        if (target == 0 || target < index) {
+            continue;
         }
+        while (index < target && node != NULL) {
+            index++;
+            node = atomic_load_explicit(forward(ht, node, level), memory_order_acquire);
+        }
+        if (node != NULL) {
+            strcpy(splits[num_splits++], node->key);
+            index++;
+            node = atomic_load_explicit(forward(ht, node, level), memory_order_acquire);
+        }
+    }
+    return num_splits;
+}
+
+void free_table(HashTable *ht) {
+    // the nodes go away with their slabs, only the arrays need to be freed
+    slab_destroy(ht->nodes);
+    slab_destroy(ht->towers);
+    slab_destroy(ht->values);
+    free(ht->queue);
+    for (int t = 0; t < 2; t++) {
+        free(atomic_load(&ht->table[t]));
     }
-    pthread_rwlock_destroy(&ht->tablelock);
+    pthread_rwlock_destroy(&ht->lock);
     free(ht);
 }
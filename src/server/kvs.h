@@ -1,49 +1,223 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+#define INITIAL_TABLE_SIZE 64 // must be a power of two
+#define MAX_LOAD_FACTOR 1     // average number of keys per bucket before growing
+#define REHASH_STEP 4         // buckets migrated per key written while resizing
+#define SKIP_LEVELS 12        // height of the ordered index, enough for 4^12 keys per table
+#define COLLECT_STEP 16       // queued nodes collect_versions looks at besides the new ones
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+#include "constants.h"
+#include "slab.h"
+
+// A value of a key, as written by the batch with the given commit version
+// (see snapshot.h). Versions are never changed once published, a write
+// pushes a new one in front of the older ones.
+// The value is kept by the storage backend, in a slot of storage_slot_size
+// bytes at the end of the version (see storage.h), read with version_value.
+typedef struct Version {
+    _Atomic(struct Version *) older;
+    uint64_t version;
+    unsigned char len;
+    unsigned char deleted;       // left by a DELETE
+    char value[];
+} Version;
+
+// The key is stored inline and never changes. Readers walk the chains
+// without locks: next is only replaced with atomic stores, removed nodes and
+// versions are freed through epoch_retire, and read_validate catches a
+// reader that followed a node moved by a resize.
+// A deleted key keeps its node, with a deleted version on top, until no
+// snapshot can read its older values.
+// Strings longer than MAX_STRING_SIZE - 1 are cut.
+// Every node is also in a skip list sorted by key. Its first level is inline,
+// the others live in a tower that only a quarter of the nodes need.
 typedef struct KeyNode {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    _Alignas(64) _Atomic(struct KeyNode *) next; // hash chain
+    _Atomic(struct KeyNode *) ordered;           // next key in order
+    _Atomic(struct KeyNode *) *tower;            // levels 1 to height - 1
+    _Atomic(Version *) versions;                 // newest first
+    uint64_t hash;
+    unsigned char key_len;
+    unsigned char height;
+    unsigned char queued;                        // in the collection queue
+    char key[MAX_STRING_SIZE];
 } KeyNode;
 
+typedef struct BucketArray {
+    size_t size; // power of two
+    _Atomic(KeyNode *) buckets[];
+} BucketArray;
+
+// While the table is growing, table[0] holds the buckets that still have to be
+// migrated (from rehash_index on) and table[1] the new, twice as large, array.
+// Each resize_step moves a few buckets, so no single operation rehashes the
+// whole table.
+// Writers hold lock for writing. seq is odd while a resize step moves nodes
+// between chains, which lets lock free readers validate their lookups.
+// Lock and sequence have a cache line of their own.
+// head is the skip list's sentinel, keeping the keys sorted for range reads.
+// Nodes written by a batch wait in the queue until their old versions, or
+// the node itself once deleted, can be dropped.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t tablelock;
+    _Alignas(64) pthread_rwlock_t lock;
+    atomic_uint seq;
+    _Alignas(64) _Atomic(BucketArray *) table[2];
+    atomic_size_t rehash_index;
+    size_t count;
+    SlabCache *nodes;            // where the KeyNodes come from
+    SlabCache *towers;           // upper levels of the skip list
+    SlabCache *values;           // Versions
+    uint64_t rng;                // picks the height of new nodes
+    _Atomic(KeyNode *) head[SKIP_LEVELS];
+    KeyNode **queue;             // ring of nodes to collect
+    size_t queue_first;
+    size_t queue_count;
+    size_t queue_capacity;
+    size_t queue_added;          // nodes queued since the last collect_versions
 } HashTable;
 
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-int hash(const char *key);
+/// Seeded string hash.
+/// @param seed Seed of the hash.
+/// @param key Key to hash, only its first MAX_STRING_SIZE - 1 characters count.
+/// @return 64 bit hash of the key.
+uint64_t hash(uint64_t seed, const char *key);
+
+/// Generates a seed for hash, different on every run.
+uint64_t new_hash_seed();
+
+/// Locks the table.
+/// @param ht Hash table.
+/// @param exclusive Non zero to lock for writing.
+void lock_table(HashTable *ht, int exclusive);
+
+/// Locks the table for writing, only if no one holds it.
+/// @param ht Hash table.
+/// @return 1 if the table was locked, 0 otherwise.
+int try_lock_table(HashTable *ht);
+
+/// Unlocks the table.
+/// @param ht Hash table.
+/// @param exclusive Must match the value given to lock_table.
+void unlock_table(HashTable *ht, int exclusive);
+
+/// Starts a lock free lookup in the table. The caller must be inside an
+/// epoch (see epoch.h). Only needed for lookups through the hash chains, the
+/// ordered index can be walked without it.
+/// @param ht Hash table.
+/// @param seq Filled with the table's sequence.
+/// @return 1 if the read can go on, 0 if a writer holds the table.
+int read_begin(HashTable *ht, unsigned *seq);
+
+/// Checks that no resize step moved nodes since read_begin.
+/// @param ht Hash table.
+/// @param seq Sequence filled by read_begin.
+/// @return 1 if every lookup since read_begin is right, 0 otherwise.
+int read_validate(HashTable *ht, unsigned seq);
 
-int find_key(HashTable *ht, const char *key);
+/// Checks if a key exists in a snapshot. The table must be locked, or the
+/// call must be between read_begin and read_validate.
+/// @param ht Hash table.
+/// @param h Hash of the key.
+/// @param key Key.
+/// @param snapshot Pinned snapshot (see snapshot.h).
+int find_key(HashTable *ht, uint64_t h, const char *key, uint64_t snapshot);
 
-// Writes a key value pair in the hash table.
+// Writes a key value pair in the hash table. The table must be write locked.
 // @param ht The hash table.
+// @param h Hash of the key.
 // @param key The key.
 // @param value The value.
+// @param version Commit version of the batch.
 // @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value, uint64_t version);
 
-// Reads the value of a given key.
+// Reads the value a key has in a snapshot, without copying it. The table
+// must be locked, or the call must be between read_begin and read_validate.
 // @param ht The hash table.
+// @param h Hash of the key.
 // @param key The key.
-// return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+// @param snapshot Pinned snapshot (see snapshot.h).
+// @param value Set to the value stored in the version, not null terminated.
+// @param len Set to the length of the value.
+// return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, uint64_t h, const char *key, uint64_t snapshot,
+              const char **value, int *len);
 
-/// Deletes a pair from the table.
+/// Deletes a pair from the table. The table must be write locked.
 /// @param ht Hash table to read from.
+/// @param h Hash of the key.
 /// @param key Key of the pair to be deleted.
+/// @param version Commit version of the batch.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, uint64_t h, const char *key, uint64_t version);
+
+/// @param node Node of a key.
+/// @param snapshot Pinned snapshot.
+/// @return The value the key has in the snapshot, NULL if it has none.
+const Version *version_at(KeyNode *node, uint64_t snapshot);
+
+/// @param v Version returned by version_at.
+/// @return Its value, len bytes, not null terminated.
+const char *version_value(const Version *v);
+
+/// Moves a value of a key out of a segment of the bitcask storage, replacing
+/// the version that points to it with a copy that points to the active
+/// segment. A delta walking the key meanwhile may see it as changed. The
+/// table must be write locked.
+/// @param ht Hash table.
+/// @param h Hash of the key.
+/// @param key Key.
+/// @param slot Storage slot of the value to move.
+/// @return 1 if a version was moved, 0 if none uses the value anymore or
+///         it could not be copied.
+int relocate_value(HashTable *ht, uint64_t h, const char *key, const void *slot);
+
+/// Drops the versions no snapshot can read anymore, and the nodes of keys
+/// deleted before every snapshot, for the nodes queued by the last writes
+/// and a few more. The table must be write locked.
+/// @param ht Hash table.
+/// @param horizon Oldest snapshot that can still be read (snapshot_horizon).
+void collect_versions(HashTable *ht, uint64_t horizon);
+
+/// Finds the first node of the table, in key order, whose key is not smaller
+/// than from. The node may have no value in a given snapshot (version_at).
+/// Safe without locks, inside an epoch.
+/// @param ht Hash table.
+/// @param from Smallest key wanted, NULL to start at the first key.
+/// @return The node of the pair, NULL if there is none.
+KeyNode *seek_pair(HashTable *ht, const char *from);
+
+/// @param node Node returned by seek_pair or next_pair.
+/// @return The node with the next key in order, NULL after the last one.
+KeyNode *next_pair(KeyNode *node);
+
+/// Picks keys that split the table in parts of about the same number of
+/// keys. Safe without locks, inside an epoch.
+/// @param ht Hash table.
+/// @param parts Number of parts wanted.
+/// @param splits Filled with the first key of every part but the first, in
+///               increasing order.
+/// @return Number of keys picked, at most parts - 1, fewer for small tables.
+size_t split_keys(HashTable *ht, size_t parts, char splits[][MAX_STRING_SIZE]);
+
+/// Starts a resize when the table is too loaded and migrates a few buckets of
+/// a resize in progress. The table must be write locked.
+/// @param ht Hash table.
+/// @param num_writes Keys written since the last step, REHASH_STEP buckets
+///                   are moved for each so the resize outpaces the growth.
+void resize_step(HashTable *ht, size_t num_writes);
 
-/// Frees the hashtable.
+/// Frees the hashtable. Every node is released with its slab, so nothing
+/// retired by the table may still be pending (see epoch_terminate).
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
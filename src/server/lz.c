@@ -0,0 +1,156 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define SKIP_SHIFT 5 // misses in a row before the search takes bigger steps
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hash4(uint32_t value) {
+  return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes a length takes past its 4 bits of the token.
+static size_t extra_bytes(size_t length) {
+  return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+static unsigned char *put_extra(unsigned char *op, size_t length) {
+  if (length < 15) {
+    return op;
+  }
+  for (length -= 15; length >= 255; length -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+// Writes a sequence, the literals and then a match unless match_len is 0.
+// @return The end of the sequence, NULL if it does not fit.
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end,
+                                   const unsigned char *literals, size_t lit_len,
+                                   size_t offset, size_t match_len) {
+  size_t match_code = match_len == 0 ? 0 : match_len - MIN_MATCH;
+  size_t needed = 1 + extra_bytes(lit_len) + lit_len +
+                  (match_len == 0 ? 0 : 2 + extra_bytes(match_code));
+  if ((size_t)(end - op) < needed) {
+    return NULL;
+  }
+  *op++ = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) |
+                          (match_code < 15 ? match_code : 15));
+  op = put_extra(op, lit_len);
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+  if (match_len > 0) {
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    op = put_extra(op, match_code);
+  }
+  return op;
+}
+
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity) {
+  uint32_t table[1 << HASH_BITS] = {0};
+  const unsigned char *end = dst + capacity;
+  unsigned char *op = dst;
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  while (ip + MIN_MATCH <= len) {
+    uint32_t sequence = read32(src + ip);
+    uint32_t h = hash4(sequence);
+    size_t ref = table[h];
+    table[h] = (uint32_t)ip;
+    if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != sequence) {
+      // data that does not compress is skipped faster and faster
+      ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+      continue;
+    }
+
+    size_t match_len = MIN_MATCH;
+    while (ip + match_len < len && src[ref + match_len] == src[ip + match_len]) {
+      match_len++;
+    }
+    op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, match_len);
+    if (op == NULL) {
+      return 0;
+    }
+    ip += match_len;
+    anchor = ip;
+  }
+
+  op = put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+  if (op == NULL || (size_t)(op - dst) >= len) {
+    return 0;
+  }
+  return (size_t)(op - dst);
+}
+
+// Reads the rest of a length whose 4 bits in the token were all set.
+// @return 0 on success, 1 if the input ends first.
+static int get_extra(const unsigned char *src, size_t len, size_t *ip, size_t *length) {
+  unsigned char byte;
+  do {
+    if (*ip >= len) {
+      return 1;
+    }
+    byte = src[(*ip)++];
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t raw_len) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < len) {
+    unsigned char token = src[ip++];
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && get_extra(src, len, &ip, &lit_len) != 0) {
+      return 1;
+    }
+    if (len - ip < lit_len || raw_len - op < lit_len) {
+      return 1;
+    }
+    memcpy(dst + op, src + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == len) {
+      break; // the last sequence has no match
+    }
+
+    if (len - ip < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_extra(src, len, &ip, &match_len) != 0) {
+      return 1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > op || raw_len - op < match_len) {
+      return 1;
+    }
+    // a match may overlap what it writes, repeating a short run
+    const unsigned char *from = dst + op - offset;
+    if (offset >= match_len) {
+      memcpy(dst + op, from, match_len);
+    } else {
+      for (size_t i = 0; i < match_len; i++) {
+        dst[op + i] = from[i];
+      }
+    }
+    op += match_len;
+  }
+  return op != raw_len;
+}
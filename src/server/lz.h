@@ -0,0 +1,29 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+// Fast LZ77 compression of small blocks, in the LZ4 block layout: a
+// sequence is a token (literal count in the high 4 bits, match length - 4 in
+// the low ones, 15 meaning more length bytes follow), the literals, a u16
+// little endian offset back into the output and the extra match length
+// bytes. The last sequence only has literals. Matches are found through a
+// hash of the next 4 bytes, so compression is one pass with no search.
+
+/// Compresses a block.
+/// @param src Data to compress.
+/// @param len Size of the data.
+/// @param dst Receives the compressed data.
+/// @param capacity Size of dst.
+/// @return Size of the compressed data, 0 if it would not be smaller than len.
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t capacity);
+
+/// Decompresses a block.
+/// @param src Compressed data.
+/// @param len Size of the compressed data.
+/// @param dst Receives the data.
+/// @param raw_len Size the data must have.
+/// @return 0 on success, 1 if the compressed data is malformed.
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t raw_len);
+
+#endif  // KVS_LZ_H
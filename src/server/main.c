@@ -6,7 +6,6 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
@@ -19,6 +18,14 @@
 #include "io.h"
 #include "subscriptions.h"
 #include "pc_buffer.h"
+#include "slab.h"
+#include "shard.h"
+#include "checkpoint.h"
+#include "executor.h"
+#include "jobc.h"
+#include "pipeline.h"
+#include "storage.h"
+#include "throttle.h"
 #include "src/common/protocol.h"
 #include "src/common/constants.h"
 
@@ -46,9 +53,6 @@ typedef struct {
   pthread_mutex_t mutex;
 } ActiveClients;
 
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
-
-size_t active_backups = 0;     // Number of active backups
 size_t max_backups;            // Maximum allowed simultaneous backups
 size_t max_threads;            // Maximum allowed simultaneous threads
 char* jobs_directory = NULL;
@@ -57,6 +61,7 @@ PCBuffer pc_buffer;
 ActiveClients active_clients = {{{0}}, PTHREAD_MUTEX_INITIALIZER};
 
 volatile sig_atomic_t sigusr1_received = 0;
+volatile sig_atomic_t sigusr2_received = 0;
 
 int deleted_keys = 0;
 typedef struct {
@@ -115,7 +120,8 @@ int notify(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STR
       value_buffer[40] = '\0';
     }
 
-    InnerNode* current = findKey(key);
+    InnerNode* subscribers = findKey(key);
+    InnerNode* current = subscribers;
     while (current != NULL) {
       int failed = 0;
 
@@ -162,7 +168,7 @@ int notify(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STR
       }
       current = current->next;
     }
-    freeInnerList(current);
+    freeInnerList(subscribers);
   }
 
   return 0;
@@ -181,6 +187,7 @@ static void *manage_subscriptions() {
   __sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
   pthread_sigmask(SIG_BLOCK, &set, NULL);
 
   int response_pipe = -1, request_pipe = -1, notification_pipe = -1;
@@ -359,119 +366,176 @@ static int entry_files(const char* dir, struct dirent* entry, char* in_path, cha
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char* filename) {
-  size_t file_backups = 0;
-  while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {{0}};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {{0}};
-    unsigned int delay;
-    size_t num_pairs;
+// Executes a command that is not a barrier into its slot, on the job's
+// thread or on a job worker. What it reports waits for retire_command.
+static void execute_command(JobCommand* cmd) {
+  cmd->failed = 0;
+  switch (cmd->command) {
+    case CMD_WRITE:
+      cmd->failed = kvs_write(cmd->num_pairs, cmd->keys, cmd->values);
+      break;
 
-    switch (get_next(in_fd)) {
-      case CMD_WRITE:
-        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+    case CMD_READ:
+      cmd->failed = kvs_read(cmd->num_pairs, cmd->keys, &cmd->output);
+      break;
 
-        if (kvs_write(num_pairs, keys, values)) {
-          write_str(STDERR_FILENO, "Failed to write pair\n");
-        } else if (notify(num_pairs, keys, values, 0)) {
-          write_str(STDERR_FILENO, "Failed to notify write\n");
-        }
-        break;
+    case CMD_DELETE:
+      cmd->failed = kvs_delete(cmd->num_pairs, cmd->keys, &cmd->output);
+      break;
 
-      case CMD_READ:
-        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    case CMD_SCAN:
+      cmd->failed = kvs_scan(cmd->keys[0], cmd->keys[1], &cmd->output);
+      break;
 
-        if (num_pairs == 0) {
-          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+    case CMD_PREFIX:
+      cmd->failed = kvs_prefix(cmd->keys[0], &cmd->output);
+      break;
 
-        if (kvs_read(num_pairs, keys, out_fd)) {
-          write_str(STDERR_FILENO, "Failed to read pair\n");
-        }
-        break;
+    case CMD_SHOW:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+}
 
-      case CMD_DELETE:
-        num_pairs = parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+// Writes out what an executed command reports and notifies its
+// subscribers, on the job's thread and in the order of the job.
+static void retire_command(JobCommand* cmd, int out_fd) {
+  output_flush(&cmd->output, out_fd);
+  switch (cmd->command) {
+    case CMD_WRITE:
+      if (cmd->failed) {
+        write_str(STDERR_FILENO, "Failed to write pair\n");
+      } else if (notify(cmd->num_pairs, cmd->keys, cmd->values, 0)) {
+        write_str(STDERR_FILENO, "Failed to notify write\n");
+      }
+      break;
 
-        if (num_pairs == 0) {
-          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+    case CMD_READ:
+      if (cmd->failed) {
+        write_str(STDERR_FILENO, "Failed to read pair\n");
+      }
+      break;
 
-        if (kvs_delete(num_pairs, keys, out_fd)) {
-          write_str(STDERR_FILENO, "Failed to delete pair\n");
-        } else if (notify(num_pairs, keys, NULL, 1)) {
-          write_str(STDERR_FILENO, "Failed to notify delete\n");
-        }
+    case CMD_DELETE:
+      if (cmd->failed) {
+        write_str(STDERR_FILENO, "Failed to delete pair\n");
+      } else if (notify(cmd->num_pairs, cmd->keys, NULL, 1)) {
+        write_str(STDERR_FILENO, "Failed to notify delete\n");
+      }
 
-        for(size_t i = 0; i < num_pairs; i++) {
-          removeKey(keys[i]);
-        }
+      for(size_t i = 0; i < cmd->num_pairs; i++) {
+        removeKey(cmd->keys[i]);
+      }
 
-        break;
+      break;
+
+    case CMD_SCAN:
+      if (cmd->failed) {
+        write_str(STDERR_FILENO, "Failed to scan keys\n");
+      }
+      break;
+
+    case CMD_PREFIX:
+      if (cmd->failed) {
+        write_str(STDERR_FILENO, "Failed to read prefix\n");
+      }
+      break;
 
+    case CMD_INVALID:
+      write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+      break;
+
+    case CMD_HELP:
+      write_str(STDOUT_FILENO,
+          "Available commands:\n"
+          "  WRITE [(key,value)(key2,value2),...]\n"
+          "  READ [key,key2,...]\n"
+          "  DELETE [key,key2,...]\n"
+          "  SHOW\n"
+          "  SCAN [from,to]\n"
+          "  PREFIX [prefix]\n"
+          "  WAIT <delay_ms>\n"
+          "  BACKUP\n" // Not implemented
+          "  HELP\n");
+
+      break;
+
+    case CMD_SHOW:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+}
+
+// Retires the commands that executed, in the order of the job, handing
+// their slots back to the parser.
+// @param max_pending Commands left pending at most, waiting for the oldest
+//   ones to execute if needed.
+static void retire_commands(JobExecutor* executor, Pipeline* pipeline, int out_fd,
+                            size_t max_pending) {
+  JobCommand* cmd;
+  while ((cmd = executor_retire(executor, executor_pending(executor) > max_pending)) != NULL) {
+    retire_command(cmd, out_fd);
+    pipeline_release(pipeline);
+  }
+}
+
+static void run_job(Pipeline* pipeline, JobExecutor* executor, int out_fd, char* filename,
+                    BackupStream* stream) {
+  size_t file_backups = 0;
+  while (1) {
+    // decoded by the parser thread meanwhile, commands that do not parse
+    // come as CMD_INVALID
+    JobCommand* cmd = pipeline_next(pipeline);
+    if (!executor_is_barrier(cmd->command)) {
+      executor_submit(executor, cmd);
+      // a slot stays free for the parser
+      retire_commands(executor, pipeline, out_fd, PIPELINE_DEPTH - 1);
+      continue;
+    }
+
+    // barriers see every earlier command done and written out
+    retire_commands(executor, pipeline, out_fd, 0);
+    switch (cmd->command) {
       case CMD_SHOW:
         kvs_show(out_fd);
         break;
 
       case CMD_WAIT:
-        if (parse_wait(in_fd, &delay, NULL) == -1) {
-          write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-
-        if (delay > 0) {
-          printf("Waiting %d seconds\n", delay / 1000);
-          kvs_wait(delay);
+        if (cmd->delay > 0) {
+          printf("Waiting %d seconds\n", cmd->delay / 1000);
+          kvs_wait(cmd->delay);
         }
         break;
 
       case CMD_BACKUP:
-        pthread_mutex_lock(&n_current_backups_lock);
-        if (active_backups >= max_backups) {
-          wait(NULL);
-        } else {
-          active_backups++;
-        }
-        pthread_mutex_unlock(&n_current_backups_lock);
-        int aux = kvs_backup(++file_backups, filename, jobs_directory);
-
-        if (aux < 0) {
-            write_str(STDERR_FILENO, "Failed to do backup\n");
-        } else if (aux == 1) {
-          return 1;
+        if (kvs_backup(stream, ++file_backups, filename, jobs_directory) < 0) {
+          write_str(STDERR_FILENO, "Failed to do backup\n");
         }
         break;
 
-      case CMD_INVALID:
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        break;
+      case EOC:
+        printf("EOF\n");
+        return;
 
+      case CMD_WRITE:
+      case CMD_READ:
+      case CMD_DELETE:
+      case CMD_SCAN:
+      case CMD_PREFIX:
       case CMD_HELP:
-        write_str(STDOUT_FILENO,
-            "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
-            "  READ [key,key2,...]\n"
-            "  DELETE [key,key2,...]\n"
-            "  SHOW\n"
-            "  WAIT <delay_ms>\n"
-            "  BACKUP\n" // Not implemented
-            "  HELP\n");
-
-        break;
-
       case CMD_EMPTY:
+      case CMD_INVALID:
         break;
-
-      case EOC:
-        printf("EOF\n");
-        return 0;
     }
+    pipeline_release(pipeline);
   }
 }
 
@@ -479,12 +543,21 @@ static void* get_file(void* arguments) {
   __sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
   pthread_sigmask(SIG_BLOCK, &set, NULL);
 
   struct SharedData* thread_data = (struct SharedData*) arguments;
   DIR* dir = thread_data->dir;
   char* dir_name = thread_data->dir_name;
 
+  // command buffers of the jobs of this thread, reused from job to job
+  Pipeline* pipeline = pipeline_create();
+  JobExecutor* executor = executor_create();
+  if (pipeline == NULL || executor == NULL) {
+    fprintf(stderr, "Failed to allocate the job pipeline\n");
+    return NULL;
+  }
+
   if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
     fprintf(stderr, "Thread failed to lock directory_mutex\n");
     return NULL;
@@ -502,8 +575,9 @@ static void* get_file(void* arguments) {
       return NULL;
     }
 
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
+    // the job runs from its compiled form, made or refreshed here
+    CompiledJob* job = jobc_open(in_path);
+    if (job == NULL) {
       write_str(STDERR_FILENO, "Failed to open input file: ");
       write_str(STDERR_FILENO, in_path);
       write_str(STDERR_FILENO, "\n");
@@ -518,19 +592,18 @@ static void* get_file(void* arguments) {
       pthread_exit(NULL);
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
+    if (pipeline_start(pipeline, job) != 0) {
+      write_str(STDERR_FILENO, "Failed to start parser thread\n");
+      pthread_exit(NULL);
+    }
 
-    if (out) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
+    BackupStream stream = {0};
+    run_job(pipeline, executor, out_fd, entry->d_name, &stream);
+    kvs_end_backups(&stream);
 
-      exit(0);
-    }
+    pipeline_stop(pipeline);
+    jobc_close(job);
+    close(out_fd);
 
     if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to lock directory_mutex\n");
@@ -543,6 +616,8 @@ static void* get_file(void* arguments) {
     return NULL;
   }
 
+  executor_destroy(executor);
+  pipeline_destroy(pipeline);
   pthread_exit(NULL);
 }
 
@@ -588,8 +663,26 @@ void handle_sigusr1() {
   sigusr1_received = 1;
 }
 
+void handle_sigusr2() {
+  // signal() may reset the handler on delivery, stats can be asked again
+  signal(SIGUSR2, handle_sigusr2);
+  sigusr2_received = 1;
+}
+
+// Writes the server's statistics, requested with SIGUSR2.
+static void report_stats(int fd) {
+  write_str(fd, "Memory usage:\n");
+  slab_report(fd);
+  kvs_report_backups(fd);
+  storage_report(fd);
+  checkpoint_report(fd);
+  throttle_report(fd);
+  executor_report(fd);
+}
+
 int main(int argc, char** argv) {
-  if(signal(SIGUSR1, handle_sigusr1) == SIG_ERR) {
+  if(signal(SIGUSR1, handle_sigusr1) == SIG_ERR ||
+     signal(SIGUSR2, handle_sigusr2) == SIG_ERR) {
     printf("Failed to set signal handler\n");
     exit(EXIT_FAILURE);
   }
@@ -601,6 +694,189 @@ int main(int argc, char** argv) {
 		write_str(STDERR_FILENO, " <max_threads>");
 		write_str(STDERR_FILENO, " <max_backups> \n");
 		write_str(STDERR_FILENO, " <register_pipe_path> \n");
+		write_str(STDERR_FILENO, " [--shards <num_shards>] \n");
+		write_str(STDERR_FILENO, " [--restore <backup_file>] \n");
+		write_str(STDERR_FILENO, " [--backup-format text|binary] \n");
+		write_str(STDERR_FILENO, " [--full-backup-every <n>] [--backup-segments <n>] \n");
+		write_str(STDERR_FILENO, " [--backup-mbps <MB/s>] [--backup-throttle fixed|adaptive] \n");
+		write_str(STDERR_FILENO, " [--backup-compression none|lz] \n");
+		write_str(STDERR_FILENO, " [--wal <log_file>] [--wal-delay-ms <ms>] [--wal-flush-bytes <n>] \n");
+		write_str(STDERR_FILENO, " [--checkpoint-dir <dir>] [--checkpoint-ms <ms>] [--checkpoint-writes <n>] \n");
+		write_str(STDERR_FILENO, " [--checkpoints-kept <n>] \n");
+		write_str(STDERR_FILENO, " [--storage memory|bitcask] [--storage-dir <dir>] [--segment-mb <MB>] \n");
+		write_str(STDERR_FILENO, " [--job-workers <n>] \n");
+    return 1;
+  }
+
+  // one shard per CPU unless told otherwise
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_shards = num_cpus < 1 ? 1 : (size_t)num_cpus;
+  if (num_shards > MAX_SHARDS) {
+    num_shards = MAX_SHARDS;
+  }
+
+  const char* restore_path = NULL;
+  BackupFormat backup_format = BACKUP_TEXT;
+  size_t full_every = 1;
+  size_t backup_segments = 1;
+  unsigned long backup_mbps = 0;
+  int adaptive_throttle = 0;
+  const char* wal_path = NULL;
+  unsigned long wal_delay_ms = 0;
+  unsigned long wal_flush_bytes = 65536;
+  CheckpointConfig checkpoint = {NULL, 0, 0, 2, BACKUP_UNCOMPRESSED};
+  StorageConfig storage = {STORAGE_MEMORY, NULL, (size_t)64 << 20};
+  size_t job_workers = 0;
+  for (int i = 5; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for option %s\n", argv[i]);
+      return 1;
+    }
+    char* end;
+    if (strcmp(argv[i], "--shards") == 0) {
+      unsigned long value = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || value == 0 || value > MAX_SHARDS) {
+        fprintf(stderr, "Invalid number of shards, must be between 1 and %d\n", MAX_SHARDS);
+        return 1;
+      }
+      num_shards = value;
+    } else if (strcmp(argv[i], "--restore") == 0) {
+      restore_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--backup-format") == 0) {
+      if (strcmp(argv[i + 1], "text") == 0) {
+        backup_format = BACKUP_TEXT;
+      } else if (strcmp(argv[i + 1], "binary") == 0) {
+        backup_format = BACKUP_BINARY;
+      } else {
+        fprintf(stderr, "Invalid backup format, must be text or binary\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--full-backup-every") == 0) {
+      unsigned long value = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || value == 0) {
+        fprintf(stderr, "Invalid number of backups between full backups\n");
+        return 1;
+      }
+      full_every = value;
+    } else if (strcmp(argv[i], "--backup-segments") == 0) {
+      unsigned long value = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || value == 0 || value > MAX_BACKUP_SEGMENTS) {
+        fprintf(stderr, "Invalid number of backup segments, must be between 1 and %d\n",
+                MAX_BACKUP_SEGMENTS);
+        return 1;
+      }
+      backup_segments = value;
+    } else if (strcmp(argv[i], "--backup-compression") == 0) {
+      // binary backups and checkpoints alike
+      if (strcmp(argv[i + 1], "none") == 0) {
+        checkpoint.compression = BACKUP_UNCOMPRESSED;
+      } else if (strcmp(argv[i + 1], "lz") == 0) {
+        checkpoint.compression = BACKUP_LZ;
+      } else {
+        fprintf(stderr, "Invalid backup compression, must be none or lz\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-mbps") == 0) {
+      backup_mbps = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || backup_mbps == 0 || backup_mbps > 1000000) {
+        fprintf(stderr, "Invalid backup rate, must be between 1 and 1000000 MB/s\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-throttle") == 0) {
+      if (strcmp(argv[i + 1], "fixed") == 0) {
+        adaptive_throttle = 0;
+      } else if (strcmp(argv[i + 1], "adaptive") == 0) {
+        adaptive_throttle = 1;
+      } else {
+        fprintf(stderr, "Invalid backup throttle, must be fixed or adaptive\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--wal") == 0) {
+      wal_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--wal-delay-ms") == 0) {
+      wal_delay_ms = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || wal_delay_ms > 1000) {
+        fprintf(stderr, "Invalid log delay, must be at most 1000 ms\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--wal-flush-bytes") == 0) {
+      wal_flush_bytes = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || wal_flush_bytes == 0) {
+        fprintf(stderr, "Invalid log flush size\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--checkpoint-dir") == 0) {
+      checkpoint.directory = argv[i + 1];
+    } else if (strcmp(argv[i], "--checkpoint-ms") == 0) {
+      checkpoint.interval_ms = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0') {
+        fprintf(stderr, "Invalid checkpoint interval\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--checkpoint-writes") == 0) {
+      checkpoint.writes = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0') {
+        fprintf(stderr, "Invalid number of writes between checkpoints\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--checkpoints-kept") == 0) {
+      checkpoint.kept = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || checkpoint.kept == 0) {
+        fprintf(stderr, "Invalid number of checkpoints to keep\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--storage") == 0) {
+      if (strcmp(argv[i + 1], "memory") == 0) {
+        storage.kind = STORAGE_MEMORY;
+      } else if (strcmp(argv[i + 1], "bitcask") == 0) {
+        storage.kind = STORAGE_BITCASK;
+      } else {
+        fprintf(stderr, "Invalid storage, must be memory or bitcask\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--storage-dir") == 0) {
+      storage.directory = argv[i + 1];
+    } else if (strcmp(argv[i], "--segment-mb") == 0) {
+      unsigned long value = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || value == 0 || value > 4095) {
+        fprintf(stderr, "Invalid segment size, must be between 1 and 4095 MB\n");
+        return 1;
+      }
+      storage.segment_bytes = (size_t)value << 20;
+    } else if (strcmp(argv[i], "--job-workers") == 0) {
+      unsigned long value = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || value > MAX_JOB_WORKERS) {
+        fprintf(stderr, "Invalid number of job workers, must be between 0 and %d\n",
+                MAX_JOB_WORKERS);
+        return 1;
+      }
+      job_workers = value;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (full_every > 1 && backup_format != BACKUP_BINARY) {
+    fprintf(stderr, "Delta backups need --backup-format binary\n");
+    return 1;
+  }
+  if (backup_segments > 1 && backup_format != BACKUP_BINARY) {
+    fprintf(stderr, "Backup segments need --backup-format binary\n");
+    return 1;
+  }
+  if (adaptive_throttle && backup_mbps == 0) {
+    fprintf(stderr, "Adaptive throttling needs --backup-mbps\n");
+    return 1;
+  }
+
+  if (storage.kind == STORAGE_BITCASK && storage.directory == NULL) {
+    fprintf(stderr, "Bitcask storage needs --storage-dir\n");
+    return 1;
+  }
+
+  if (checkpoint.directory != NULL && checkpoint.interval_ms == 0 && checkpoint.writes == 0) {
+    fprintf(stderr, "Checkpoints need --checkpoint-ms or --checkpoint-writes\n");
     return 1;
   }
 
@@ -631,10 +907,49 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
-  if (kvs_init()) {
+  if (kvs_init(num_shards, &storage)) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
+  set_max_backups((int)max_backups);
+  set_backup_format(backup_format);
+  set_full_backup_every(full_every);
+  set_backup_segments(backup_segments);
+  set_backup_compression(checkpoint.compression);
+  throttle_init((uint64_t)backup_mbps * 1000000, adaptive_throttle);
+
+  // without a backup to restore, the server starts from its last checkpoint
+  char checkpoint_path[PATH_MAX];
+  if (restore_path == NULL && checkpoint.directory != NULL &&
+      checkpoint_latest(checkpoint.directory, checkpoint_path, sizeof(checkpoint_path)) == 0) {
+    restore_path = checkpoint_path;
+  }
+
+  if (restore_path != NULL && kvs_restore(restore_path, max_threads)) {
+    write_str(STDERR_FILENO, "Failed to restore backup\n");
+    kvs_terminate();
+    return 1;
+  }
+
+  // the log holds what happened after the backup, it goes on top of it
+  if (wal_path != NULL &&
+      kvs_open_wal(wal_path, (unsigned int)wal_delay_ms, (size_t)wal_flush_bytes)) {
+    write_str(STDERR_FILENO, "Failed to open write-ahead log\n");
+    kvs_terminate();
+    return 1;
+  }
+
+  if (checkpoint.directory != NULL && checkpoint_start(&checkpoint)) {
+    kvs_terminate();
+    return 1;
+  }
+
+  // without job workers every job runs its commands one after the other
+  if (executor_init(job_workers, execute_command)) {
+    write_str(STDERR_FILENO, "Failed to start job workers\n");
+    kvs_terminate();
+    return 1;
+  }
 
   DIR* dir = opendir(argv[1]);
   if (dir == NULL) {
@@ -659,7 +974,14 @@ int main(int argc, char** argv) {
   dispatch_session_threads();
   dispatch_job_threads(dir);
 
-  int register_pipe = open(register_pipe_path, O_RDONLY);
+  // a signal may come before the first client opens the pipe
+  int register_pipe;
+  while ((register_pipe = open(register_pipe_path, O_RDONLY)) == -1 && errno == EINTR) {
+    if (sigusr2_received) {
+      report_stats(STDERR_FILENO);
+      sigusr2_received = 0;
+    }
+  }
   if (register_pipe == -1) {
     fprintf(stderr, "Failed to open register pipe\n");
     return 1;
@@ -675,6 +997,11 @@ int main(int argc, char** argv) {
       sigusr1_received = 0;
     }
 
+    if(sigusr2_received) {
+      report_stats(STDERR_FILENO);
+      sigusr2_received = 0;
+    }
+
     while ((bytes_read = (int)read(register_pipe, register_message, 121)) > 0) {
       if (bytes_read == 121 && register_message[0] == OP_CODE_CONNECT) {
         processed_registry = process_register_message(register_message);
@@ -708,13 +1035,11 @@ int main(int argc, char** argv) {
     return 0;
   }
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
-  }
+  kvs_wait_backup();
 
   sem_destroy(&pc_buffer.semaphore);
   pthread_mutex_destroy(&pc_buffer.mutex);
+  executor_stop();
   kvs_terminate();
 
   return 0;
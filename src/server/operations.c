@@ -1,17 +1,95 @@
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
+#include "checkpoint.h"
 #include "constants.h"
+#include "cursor.h"
+#include "epoch.h"
 #include "io.h"
 #include "kvs.h"
 #include "operations.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "storage.h"
+#include "throttle.h"
+#include "wal.h"
 
-static struct HashTable *kvs_table = NULL;
+#define MAX_READ_RETRIES 8 // lock free attempts before a reader takes the locks
+#define SHOW_CHUNK 256     // pairs SHOW copies at a time
+
+static int initialized = 0;
+
+typedef struct BackupArgs BackupArgs;
+
+// A BACKUP takes its snapshot right away and queues the writing, so the job
+// goes on with its next commands. max_backups workers, started with the
+// first backup, write the queued backups in order.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // signaled when a backup is queued, or to stop
+  pthread_cond_t done;   // signaled when a backup finishes
+  BackupArgs *first;     // queue of backups waiting for a worker
+  BackupArgs *last;
+  size_t num_queued;
+  size_t active;         // queued or being written
+  size_t max;
+  pthread_t *workers;
+  size_t num_workers;
+  int stopping;
+  BackupFormat format;
+  BackupCompression compression;
+  size_t full_every;     // 1 when every backup is full
+  size_t segments;       // files a binary backup is split in, 1 for one file
+  unsigned long written;
+  size_t deepest;        // longest the queue has been
+  uint64_t waited_ms;    // time backups spent in the queue
+  uint64_t longest_wait_ms;
+} backups = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+             NULL, NULL, 0, 0, 1, NULL, 0, 0, BACKUP_TEXT, BACKUP_UNCOMPRESSED, 1, 1,
+             0, 0, 0, 0};
+
+// A key range of a backup split in segments, written by a thread of its own.
+typedef struct {
+  Cursor *cursor;
+  CursorPair *pairs;         // SHOW_CHUNK of them
+  const BackupInfo *info;
+  BackupCompression compression;
+  pthread_t thread;
+  int failed;
+  char path[PATH_MAX];
+} BackupSegment;
+
+struct BackupArgs {
+  BackupFormat format;
+  BackupCompression compression;
+  BackupInfo info;
+  Cursor *cursor;
+  CursorPair *pairs;         // SHOW_CHUNK of them
+  SnapshotHold *since_hold;  // base of a delta, released once it is written
+  size_t num_segments;       // 0 when the backup is a single file
+  BackupSegment *segments;
+  struct timespec queued_at;
+  BackupChain *chain;        // of a binary backup when deltas are on
+  struct BackupArgs *next;   // in the queue
+  char path[PATH_MAX];
+};
+
+// The backups of a stream since its last full one. The stream may end before
+// they are written, so whoever lets go of it last frees it. Under the lock of
+// the backups.
+struct BackupChain {
+  size_t refs;               // the stream, and its backups not written yet
+  int broken;                // a backup of the chain was not written
+};
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -20,171 +98,1013 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init() {
-  if (kvs_table != NULL) {
+int kvs_init(size_t num_shards, const StorageConfig *storage) {
+  if (initialized) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  // the tables size their versions after the backend
+  if (storage_init(storage) != 0) {
+    return 1;
+  }
+  if (shards_init(num_shards) != 0) {
+    storage_terminate();
+    return 1;
+  }
+  initialized = 1;
+  return 0;
+}
+
+/// Body of a read only operation, may run more than once.
+typedef void (*read_fn)(void *arg);
+
+/// Runs lookups without taking any lock. If a resize moves nodes in one of
+/// their shards meanwhile, the body is run again, and after
+/// MAX_READ_RETRIES failed attempts it runs under the shards' read locks.
+/// @param batch Shards of every key the body reads.
+/// @param body Function doing the reads.
+/// @param arg Argument of the body.
+static void optimistic_read(const ShardBatch *batch, read_fn body, void *arg) {
+  unsigned seqs[MAX_WRITE_SIZE];
+
+  epoch_enter();
+  for (int attempt = 0; attempt < MAX_READ_RETRIES; attempt++) {
+    if (read_batch_begin(batch, seqs)) {
+      body(arg);
+      if (read_batch_validate(batch, seqs)) {
+        epoch_exit();
+        return;
+      }
+    }
+    sched_yield();
+  }
+
+  lock_batch(batch, 0);
+  body(arg);
+  unlock_batch(batch, 0);
+  epoch_exit();
+}
+
+struct FindArgs {
+  uint64_t hash;
+  const char *key;
+  uint64_t snapshot;
+  int found;
+};
+
+static void find_body(void *arg) {
+  struct FindArgs *args = arg;
+  args->found = find_key(shard_table(shard_of(args->hash)), args->hash, args->key, args->snapshot);
 }
 
 int kvs_find_key(const char *key) {
-  if (kvs_table == NULL) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  int result = find_key(kvs_table, key); 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  return result;
+  ShardBatch batch;
+  char keys[1][MAX_STRING_SIZE];
+  strncpy(keys[0], key, MAX_STRING_SIZE - 1);
+  keys[0][MAX_STRING_SIZE - 1] = '\0';
+  shard_batch(&batch, 1, keys);
+
+  struct FindArgs args = {batch.hashes[0], key, snapshot_pin(), 0};
+  optimistic_read(&batch, find_body, &args);
+  snapshot_unpin();
+  return args.found;
 }
 
+static void stop_backups();
+
 int kvs_terminate() {
-  if (kvs_table == NULL) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
+  checkpoint_stop();
+  kvs_wait_backup();
+  stop_backups();
+  wal_close();
+  storage_stop();
+  shards_terminate();
+  storage_terminate();
+  initialized = 0;
   return 0;
 }
 
+// A WRITE or DELETE batch, applied either by its own thread or by the
+// thread that combines the batches waiting on its shard.
+typedef struct WriteRequest {
+  const ShardBatch *batch;
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE]; // NULL for a DELETE
+  size_t *missing;                 // keys a DELETE did not find
+  size_t num_missing;
+  uint64_t lsn;                    // where the log has it, see wal_sync
+  atomic_int done;
+  struct WriteRequest *next;
+} WriteRequest;
+
+// Batches waiting for a shard's write lock, pushed by their threads and
+// taken all at once by the one that gets the lock.
+typedef struct {
+  _Alignas(64) _Atomic(WriteRequest *) pending;
+} Combiner;
+
+static Combiner combiners[MAX_SHARDS];
+
+/// Applies a batch. Its shards must be write locked.
+/// @param req The batch.
+/// @param version Version it commits with.
+static void apply_request(WriteRequest *req, uint64_t version) {
+  const ShardBatch *batch = req->batch;
+  req->lsn = wal_log(req->values == NULL ? WAL_DELETE : WAL_WRITE, batch->num_keys,
+                     req->keys, req->values);
+  if (req->values == NULL) {
+    for (size_t i = 0; i < batch->num_keys; i++) {
+      uint64_t h = batch->hashes[i];
+      if (delete_pair(shard_table(shard_of(h)), h, req->keys[i], version) != 0) {
+        req->missing[req->num_missing++] = i;
+      }
+    }
+    return;
+  }
+
+  // shard by shard, repeated keys still go in batch order
+  for (size_t s = 0; s < batch->num_shards; s++) {
+    HashTable *table = shard_table(batch->shards[s]);
+    for (size_t j = batch->first[s]; j < batch->first[s + 1]; j++) {
+      size_t i = batch->order[j];
+      if (write_pair(table, batch->hashes[i], req->keys[i], req->values[i], version) != 0) {
+        fprintf(stderr, "Failed to write key pair (%s,%s)\n", req->keys[i], req->values[i]);
+      }
+    }
+  }
+}
+
+/// Drops the versions of a write locked shard that no snapshot needs
+/// anymore and moves its resize on, once a batch was committed.
+/// @param table Table of the shard.
+/// @param horizon Oldest snapshot still pinned (snapshot_horizon).
+/// @param num_writes Keys written in the shard.
+static void tidy_shard(HashTable *table, uint64_t horizon, size_t num_writes) {
+  collect_versions(table, horizon);
+  resize_step(table, num_writes);
+}
+
+/// Applies a batch that spans several shards, locking them all.
+/// @param req The batch.
+static void apply_locked(WriteRequest *req) {
+  lock_batch(req->batch, 1);
+  uint64_t version = snapshot_begin_commit();
+  apply_request(req, version);
+  snapshot_commit(version);
+  uint64_t horizon = snapshot_horizon();
+  for (size_t s = 0; s < req->batch->num_shards; s++) {
+    tidy_shard(shard_table(req->batch->shards[s]), horizon,
+               req->batch->first[s + 1] - req->batch->first[s]);
+  }
+  unlock_batch(req->batch, 1);
+}
+
+/// Applies every batch waiting on a shard, whose lock the caller holds, in
+/// one pass and with one version, then releases the lock and their threads.
+/// @param shard The shard.
+static void combine(size_t shard) {
+  HashTable *table = shard_table(shard);
+  WriteRequest *list = atomic_exchange_explicit(&combiners[shard].pending, NULL,
+                                                memory_order_acquire);
+  // the list is newest first, batches are applied in the order they came
+  WriteRequest *ordered = NULL;
+  while (list != NULL) {
+    WriteRequest *next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  if (ordered != NULL) {
+    uint64_t version = snapshot_begin_commit();
+    size_t num_writes = 0;
+    for (WriteRequest *req = ordered; req != NULL; req = req->next) {
+      apply_request(req, version);
+      num_writes += req->batch->num_keys;
+    }
+    snapshot_commit(version);
+    tidy_shard(table, snapshot_horizon(), num_writes);
+  }
+  unlock_table(table, 1);
+
+  while (ordered != NULL) {
+    WriteRequest *next = ordered->next; // the request is gone once done
+    atomic_store_explicit(&ordered->done, 1, memory_order_release);
+    ordered = next;
+  }
+}
+
+/// Applies a WRITE or DELETE batch. Batches of a single shard are handed
+/// to whichever thread holds the shard's lock, so that a busy shard changes
+/// hands once for many small batches instead of once per batch.
+/// @param req The batch.
+/// @return 0 once the batch is applied and logged, 1 if the log failed.
+static int submit_request(WriteRequest *req) {
+  if (req->batch->num_shards > 1) {
+    apply_locked(req);
+    return wal_sync(req->lsn);
+  }
+
+  size_t shard = req->batch->shards[0];
+  atomic_init(&req->done, 0);
+  req->next = atomic_load_explicit(&combiners[shard].pending, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&combiners[shard].pending, &req->next, req,
+                                                memory_order_release, memory_order_relaxed))
+    ;
+
+  while (!atomic_load_explicit(&req->done, memory_order_acquire)) {
+    if (try_lock_table(shard_table(shard))) {
+      combine(shard);
+    } else {
+      sched_yield();
+    }
+  }
+  // the log is synced after the locks are released, for many batches at once
+  return wal_sync(req->lsn);
+}
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  ShardBatch batch;
+  shard_batch(&batch, num_pairs, keys);
+  WriteRequest req = {&batch, keys, values, NULL, 0, 0, 0, NULL};
+  uint64_t start = throttle_begin_write();
+  int failed = submit_request(&req);
+  throttle_end_write(start);
+  checkpoint_note_writes(num_pairs);
+  return failed;
+}
+
+struct ReadArgs {
+  const ShardBatch *batch;
+  uint64_t snapshot;
+  size_t num_pairs;
+  char (*keys)[MAX_STRING_SIZE];
+  char *output;
+  size_t len;
+};
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+// Formats a READ line into args->output.
+static void read_pairs_body(void *arg) {
+  struct ReadArgs *args = arg;
+  args->len = 0;
+  args->output[args->len++] = '[';
+  for (size_t i = 0; i < args->num_pairs; i++) {
+    const char *value;
+    int value_len;
+    char *aux = args->output + args->len;
+    int written;
+    // formatted straight from the version, no copy of the value is made
+    uint64_t h = args->batch->hashes[i];
+    if (read_pair(shard_table(shard_of(h)), h, args->keys[i], args->snapshot,
+                  &value, &value_len) != 0) {
+      written = snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", args->keys[i]);
+    } else {
+      written = snprintf(aux, MAX_STRING_SIZE, "(%s,%.*s)", args->keys[i], value_len, value);
     }
+    // each pair is cut at MAX_STRING_SIZE - 1 characters, like before
+    args->len += written < 0 ? 0 : strnlen(aux, MAX_STRING_SIZE - 1);
   }
-
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  return 0;
+  args->output[args->len++] = ']';
+  args->output[args->len++] = '\n';
+  args->output[args->len] = '\0';
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
 
-  write_str(fd, "[");
-  for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
-    }
-    write_str(fd, aux);
-    free(result);
+  ShardBatch batch;
+  shard_batch(&batch, num_pairs, keys);
+
+  // every key is read in the same snapshot, without locks, and the output
+  // is written once no resize moved a key under the lookups
+  struct ReadArgs args = {&batch, 0, num_pairs, keys, malloc(num_pairs * MAX_STRING_SIZE + 3), 0};
+  if (args.output == NULL) {
+    return 1;
   }
-  write_str(fd, "]\n");
-  
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  return 0;
+
+  args.snapshot = snapshot_pin();
+  optimistic_read(&batch, read_pairs_body, &args);
+  snapshot_unpin();
+
+  int failed = output_str(out, args.output);
+  free(args.output);
+  return failed;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
 
-  int aux = 0;
-  for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write_str(fd, "[");
-        aux = 1;
-      }
+  // keys that were not found, reported after releasing the locks
+  size_t missing[num_pairs];
+  size_t num_missing = 0;
+
+  ShardBatch batch;
+  shard_batch(&batch, num_pairs, keys);
+  WriteRequest req = {&batch, keys, NULL, missing, 0, 0, 0, NULL};
+  uint64_t start = throttle_begin_write();
+  int failed = submit_request(&req);
+  throttle_end_write(start);
+  checkpoint_note_writes(num_pairs);
+  num_missing = req.num_missing;
+
+  if (num_missing > 0) {
+    failed |= output_str(out, "[");
+    for (size_t i = 0; i < num_missing; i++) {
       char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[missing[i]]);
+      failed |= output_str(out, str);
     }
+    failed |= output_str(out, "]\n");
   }
-  if (aux) {
-    write_str(fd, "]\n");
+  return failed;
+}
+
+struct RangeArgs {
+  uint64_t snapshot;
+  const char *from;
+  const char *to;      // last key of a SCAN, NULL for a PREFIX
+  size_t prefix_len;
+  char *output;
+  size_t len;
+  size_t capacity;
+  int failed;
+};
+
+// Appends a pair of a SCAN or PREFIX to the output, growing it as needed.
+// @return Non zero once past the range, or if the output can not grow.
+static int range_pair(const char *key, const char *value, int value_len, void *arg) {
+  struct RangeArgs *args = arg;
+  if (args->to != NULL ? strncmp(key, args->to, MAX_STRING_SIZE - 1) > 0
+                       : strncmp(key, args->from, args->prefix_len) != 0) {
+    return 1;
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  // room for the pair plus the closing "]\n"
+  if (args->capacity - args->len < 2 * MAX_STRING_SIZE + 3) {
+    char *output = realloc(args->output, args->capacity * 2);
+    if (output == NULL) {
+      args->failed = 1;
+      return 1;
+    }
+    args->output = output;
+    args->capacity *= 2;
+  }
+  int written = snprintf(args->output + args->len, args->capacity - args->len, "(%s,%.*s)",
+                         key, value_len, value);
+  args->len += written < 0 ? 0 : (size_t)written;
   return 0;
 }
 
+// Formats a SCAN or PREFIX line into args->output.
+static void range_body(void *arg) {
+  struct RangeArgs *args = arg;
+  args->len = 0;
+  args->failed = 0;
+  args->output[args->len++] = '[';
+  foreach_range(args->snapshot, args->from, range_pair, args);
+  args->output[args->len++] = ']';
+  args->output[args->len++] = '\n';
+  args->output[args->len] = '\0';
+}
+
+/// Outputs the pairs of a key range, in key order.
+/// @param args Range to read, with an empty output.
+/// @param out Output of the command.
+/// @return 0 if the range was read, 1 otherwise.
+static int read_range(struct RangeArgs *args, OutputBuffer *out) {
+  args->capacity = 16 * MAX_STRING_SIZE;
+  args->output = malloc(args->capacity);
+  if (args->output == NULL) {
+    return 1;
+  }
+
+  // the ordered indexes are walked without locks, in one snapshot
+  args->snapshot = snapshot_pin();
+  epoch_enter();
+  range_body(args);
+  epoch_exit();
+  snapshot_unpin();
+
+  if (!args->failed) {
+    args->failed = output_str(out, args->output);
+  }
+  free(args->output);
+  return args->failed;
+}
+
+int kvs_scan(const char *from, const char *to, OutputBuffer *out) {
+  if (!initialized) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  struct RangeArgs args = {0, from, to, 0, NULL, 0, 0, 0};
+  return read_range(&args, out);
+}
+
+int kvs_prefix(const char *prefix, OutputBuffer *out) {
+  if (!initialized) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  struct RangeArgs args = {0, prefix, NULL, strnlen(prefix, MAX_STRING_SIZE - 1), NULL, 0, 0, 0};
+  return read_range(&args, out);
+}
+
+/// Writes out what is left of a dump, a "(key, value)" line per pair.
+/// @param cursor Cursor of the dump.
+/// @param pairs Room for SHOW_CHUNK pairs.
+/// @param fd File descriptor to write to.
+/// @param throttled Non zero for a backup, which shares the backups' rate.
+static void write_dump(Cursor *cursor, CursorPair *pairs, int fd, int throttled) {
+  size_t count;
+  while ((count = cursor_next(cursor, pairs, SHOW_CHUNK)) > 0) {
+    if (throttled) {
+      throttle_acquire(cursor_pairs_size(pairs, count) + count * 5);
+    }
+    for (size_t i = 0; i < count; i++) {
+      char aux[2 * MAX_STRING_SIZE + 4];
+      snprintf(aux, sizeof(aux), "(%s, %s)\n", pairs[i].key, pairs[i].value);
+      aux[MAX_STRING_SIZE - 1] = '\0'; // lines are cut like before
+      write_str(fd, aux);
+    }
+  }
+}
+
 void kvs_show(int fd) {
-  if (kvs_table == NULL) {
+  if (!initialized) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
-  
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
-  
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
-    }
-  }
-
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-}
-
-int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory, strtok(job_filename, "."),
-           num_backup);
-
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  if (pid == 0) {
-    // functions used here have to be async signal safe, since this
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->key, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ", ", MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->value, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
+
+  CursorPair *pairs = malloc(SHOW_CHUNK * sizeof(CursorPair));
+  Cursor *cursor = pairs == NULL ? NULL : cursor_open();
+  if (cursor == NULL) {
+    fprintf(stderr, "Failed to start SHOW\n");
+    free(pairs);
+    return;
+  }
+
+  // the dump reads a snapshot, writers go on while it is written out, and
+  // the pairs come out sorted by key
+  write_dump(cursor, pairs, fd, 0);
+  cursor_close(cursor);
+  free(pairs);
+}
+
+/// Counts a backup out, written or given up.
+static void backup_finished(int written) {
+  pthread_mutex_lock(&backups.lock);
+  backups.active--;
+  backups.written += written != 0;
+  pthread_cond_broadcast(&backups.done);
+  pthread_mutex_unlock(&backups.lock);
+}
+
+/// Lets go of a chain of backups.
+/// @param chain The chain.
+/// @param broken Non zero if one of its backups was not written.
+static void release_chain(BackupChain *chain, int broken) {
+  pthread_mutex_lock(&backups.lock);
+  chain->broken = chain->broken || broken;
+  int last = --chain->refs == 0;
+  pthread_mutex_unlock(&backups.lock);
+  if (last) {
+    free(chain);
+  }
+}
+
+static void free_backup(BackupArgs *args) {
+  for (size_t i = 0; i < args->num_segments; i++) {
+    if (args->segments[i].cursor != NULL) {
+      cursor_close(args->segments[i].cursor);
+    }
+    free(args->segments[i].pairs);
+  }
+  free(args->segments);
+  if (args->cursor != NULL) {
+    cursor_close(args->cursor);
+  }
+  if (args->since_hold != NULL) {
+    snapshot_release(args->since_hold);
+  }
+  if (args->chain != NULL) {
+    release_chain(args->chain, 0);
+  }
+  free(args->pairs);
+  free(args);
+}
+
+/// Writes what is left of a dump, or of a dump of changes, as a binary backup.
+/// @param cursor The dump.
+/// @param pairs Room for SHOW_CHUNK pairs.
+/// @param info Header fields of the backup.
+/// @param compression How the blocks are stored.
+/// @param fd File descriptor of the backup file.
+/// @return 0 if the backup was written, 1 otherwise.
+static int write_binary(Cursor *cursor, CursorPair *pairs, const BackupInfo *info,
+                        BackupCompression compression, int fd) {
+  BackupWriter *writer = backup_writer_open(fd, compression);
+  if (writer == NULL) {
+    return 1;
+  }
+  int failed = 0;
+  size_t count;
+  while (!failed && (count = cursor_next(cursor, pairs, SHOW_CHUNK)) > 0) {
+    throttle_acquire(cursor_pairs_size(pairs, count) + count * 2);
+    for (size_t i = 0; i < count && !failed; i++) {
+      const CursorPair *pair = &pairs[i];
+      failed = backup_writer_put(writer, pair->key, pair->deleted ? NULL : pair->value);
+    }
+  }
+  return backup_writer_close(writer, info, failed);
+}
+
+// Writes a segment of a backup to its file.
+static void *segment_thread(void *arg) {
+  BackupSegment *segment = arg;
+  int fd = open(segment->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open backup file %s\n", segment->path);
+    segment->failed = 1;
+    return NULL;
+  }
+  segment->failed = write_binary(segment->cursor, segment->pairs, segment->info,
+                                 segment->compression, fd);
+  segment->failed = close(fd) != 0 || segment->failed;
+  return NULL;
+}
+
+/// Writes the segments of a backup in parallel, then its manifest, which is
+/// only there once every segment is complete.
+/// @param args The backup.
+/// @return 0 if the backup was written, 1 otherwise.
+static int write_segments(BackupArgs *args) {
+  // this thread writes the first segment itself
+  size_t started = 1;
+  for (; started < args->num_segments; started++) {
+    BackupSegment *segment = &args->segments[started];
+    if (pthread_create(&segment->thread, NULL, segment_thread, segment) != 0) {
+      break;
+    }
+  }
+  for (size_t i = started; i < args->num_segments; i++) {
+    segment_thread(&args->segments[i]);
+  }
+  segment_thread(&args->segments[0]);
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(args->segments[i].thread, NULL);
+  }
+
+  const char *names[MAX_BACKUP_SEGMENTS];
+  int failed = 0;
+  for (size_t i = 0; i < args->num_segments; i++) {
+    const char *slash = strrchr(args->segments[i].path, '/');
+    names[i] = slash == NULL ? args->segments[i].path : slash + 1;
+    failed = failed || args->segments[i].failed;
+  }
+  if (failed) {
+    return 1;
+  }
+  int fd = open(args->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return 1;
+  }
+  failed = backup_manifest_write(fd, &args->info, args->num_segments, names);
+  return close(fd) != 0 || failed;
+}
+
+/// Splits the dump opened for a backup in key ranges of about the same size.
+/// @param args The backup, its cursor open.
+/// @param parts Number of segments wanted, fewer are used for small stores.
+/// @return 0 on success, 1 otherwise.
+static int split_backup(BackupArgs *args, size_t parts) {
+  char splits[MAX_BACKUP_SEGMENTS][MAX_STRING_SIZE];
+  size_t num_splits = cursor_split_keys(parts, splits);
+  args->segments = calloc(num_splits + 1, sizeof(BackupSegment));
+  if (args->segments == NULL) {
+    return 1;
+  }
+  args->num_segments = num_splits + 1;
+  for (size_t i = 0; i < args->num_segments; i++) {
+    BackupSegment *segment = &args->segments[i];
+    segment->info = &args->info;
+    segment->compression = args->compression;
+    snprintf(segment->path, sizeof(segment->path), "%.*s.%u", PATH_MAX - 16, args->path,
+             (unsigned)i);
+    segment->pairs = malloc(SHOW_CHUNK * sizeof(CursorPair));
+    segment->cursor = cursor_open_part(args->cursor, i == 0 ? NULL : splits[i - 1],
+                                       i == num_splits ? NULL : splits[i]);
+    if (segment->pairs == NULL || segment->cursor == NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Writes the dump opened for a backup to its file.
+/// @param args The backup.
+/// @return 0 if the backup was written, 1 otherwise.
+static int write_backup(BackupArgs *args) {
+  if (args->num_segments > 0) {
+    if (write_segments(args) != 0) {
+      fprintf(stderr, "Failed to write backup file %s\n", args->path);
+      return 1;
+    }
+    return 0;
+  }
+
+  int fd = open(args->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open backup file %s\n", args->path);
+    return 1;
+  }
+  int failed = 0;
+  if (args->format == BACKUP_BINARY) {
+    failed = write_binary(args->cursor, args->pairs, &args->info, args->compression, fd);
+    if (failed) {
+      fprintf(stderr, "Failed to write backup file %s\n", args->path);
+    }
+  } else {
+    write_dump(args->cursor, args->pairs, fd, 1);
+  }
+  close(fd);
+  return failed;
+}
+
+static uint64_t elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t ms = (int64_t)(now.tv_sec - since->tv_sec) * 1000 +
+               (now.tv_nsec - since->tv_nsec) / 1000000;
+  return ms < 0 ? 0 : (uint64_t)ms;
+}
+
+// Writes queued backups until told to stop.
+static void *backup_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&backups.lock);
+  while (1) {
+    while (backups.first == NULL && !backups.stopping) {
+      pthread_cond_wait(&backups.queued, &backups.lock);
+    }
+    if (backups.first == NULL) {
+      break; // stopping, and nothing left to write
+    }
+    BackupArgs *args = backups.first;
+    backups.first = args->next;
+    if (backups.first == NULL) {
+      backups.last = NULL;
+    }
+    backups.num_queued--;
+    uint64_t waited = elapsed_ms(&args->queued_at);
+    backups.waited_ms += waited;
+    if (waited > backups.longest_wait_ms) {
+      backups.longest_wait_ms = waited;
+    }
+    pthread_mutex_unlock(&backups.lock);
+
+    int failed = write_backup(args);
+    if (failed && args->chain != NULL) {
+      // the deltas after it would build on a file that is not there
+      release_chain(args->chain, 1);
+      args->chain = NULL;
+    }
+    free_backup(args);
+    backup_finished(!failed);
+    pthread_mutex_lock(&backups.lock);
+  }
+  pthread_mutex_unlock(&backups.lock);
+  return NULL;
+}
+
+/// Queues a backup, starting the workers if they are not running yet.
+/// @param args The backup, its dump open.
+/// @return 0 on success, 1 if no worker could be started.
+static int queue_backup(BackupArgs *args) {
+  clock_gettime(CLOCK_MONOTONIC, &args->queued_at);
+  args->next = NULL;
+
+  pthread_mutex_lock(&backups.lock);
+  if (backups.workers == NULL && !backups.stopping) {
+    backups.workers = calloc(backups.max, sizeof(pthread_t));
+    for (size_t i = 0; backups.workers != NULL && i < backups.max; i++) {
+      if (pthread_create(&backups.workers[i], NULL, backup_worker, NULL) != 0) {
+        break;
       }
+      backups.num_workers++;
     }
-    exit(1);
-  } else if (pid < 0) {
+  }
+  if (backups.num_workers == 0) {
+    pthread_mutex_unlock(&backups.lock);
+    return 1;
+  }
+  if (backups.last == NULL) {
+    backups.first = args;
+  } else {
+    backups.last->next = args;
+  }
+  backups.last = args;
+  backups.num_queued++;
+  if (backups.num_queued > backups.deepest) {
+    backups.deepest = backups.num_queued;
+  }
+  pthread_cond_signal(&backups.queued);
+  pthread_mutex_unlock(&backups.lock);
+  return 0;
+}
+
+int kvs_backup(BackupStream *stream, size_t num_backup, char *job_filename,
+               char *directory) {
+  BackupArgs *args = calloc(1, sizeof(BackupArgs));
+  if (args == NULL) {
     return -1;
   }
+  snprintf(args->path, sizeof(args->path), "%s/%s-%ld.bck", directory,
+           strtok(job_filename, "."), num_backup);
+
+  // never waits for a worker: the backup only needs its snapshot now
+  pthread_mutex_lock(&backups.lock);
+  backups.active++;
+  args->format = backups.format;
+  args->compression = backups.compression;
+  int deltas = backups.format == BACKUP_BINARY && backups.full_every > 1;
+  int delta = deltas && stream->chain != NULL && !stream->chain->broken &&
+              stream->since_full + 1 < backups.full_every;
+  size_t segments = backups.format == BACKUP_BINARY ? backups.segments : 1;
+  pthread_mutex_unlock(&backups.lock);
+
+  // the snapshot is taken here and the worker only reads it: no lock is
+  // taken, and nothing the job writes after the BACKUP gets in the file
+  args->pairs = malloc(SHOW_CHUNK * sizeof(CursorPair));
+  if (args->pairs != NULL) {
+    args->cursor = delta ? cursor_open_since(stream->base) : cursor_open();
+  }
+  uint64_t snapshot = 0;
+  uint64_t id = delta ? stream->id : new_hash_seed();
+  BackupChain *chain = stream->chain;
+  if (args->cursor != NULL) {
+    snapshot = cursor_snapshot(args->cursor);
+    if (delta) {
+      // the worker needs the base until the delta is written
+      args->info = (BackupInfo){BACKUP_DELTA, id, snapshot, stream->base};
+      args->since_hold = snapshot_hold_at(stream->base);
+    } else {
+      args->info = (BackupInfo){BACKUP_FULL, id, snapshot, 0};
+      chain = deltas ? calloc(1, sizeof(BackupChain)) : NULL;
+      if (chain != NULL) {
+        chain->refs = 1; // the stream's
+      }
+    }
+  }
+
+  // the ranges are picked from the store as it is now, not the snapshot,
+  // which can only make the segments a little uneven
+  int failed = args->cursor == NULL || (deltas && chain == NULL) ||
+               (segments > 1 && split_backup(args, segments) != 0);
+  SnapshotHold *base_hold = NULL;
+  if (!failed && deltas) {
+    // held before the worker can close the cursor pinning the snapshot
+    base_hold = snapshot_hold_at(snapshot);
+    pthread_mutex_lock(&backups.lock);
+    chain->refs++;
+    pthread_mutex_unlock(&backups.lock);
+    args->chain = chain;
+  }
+  if (failed || queue_backup(args) != 0) {
+    // the stream keeps its base, this backup is as if never asked for
+    if (base_hold != NULL) {
+      snapshot_release(base_hold);
+    }
+    if (chain != NULL && chain != stream->chain) {
+      release_chain(chain, 0); // the ref the stream would have taken
+    }
+    free_backup(args);
+    backup_finished(0);
+    return -1;
+  }
+
+  // the worker may be done with args already. The next delta of the job is
+  // based on this backup, unless it turns out it could not be written
+  if (!delta) {
+    kvs_end_backups(stream);
+    stream->chain = chain;
+    stream->id = id;
+    stream->since_full = 0;
+  } else {
+    stream->since_full++;
+  }
+  if (stream->base_hold != NULL) {
+    snapshot_release(stream->base_hold);
+  }
+  stream->base_hold = base_hold;
+  stream->base = snapshot;
+  return 0;
+}
+
+void kvs_end_backups(BackupStream *stream) {
+  if (stream->base_hold != NULL) {
+    snapshot_release(stream->base_hold);
+    stream->base_hold = NULL;
+  }
+  if (stream->chain != NULL) {
+    release_chain(stream->chain, 0);
+    stream->chain = NULL;
+  }
+}
+
+void kvs_wait_backup() {
+  pthread_mutex_lock(&backups.lock);
+  while (backups.active > 0) {
+    pthread_cond_wait(&backups.done, &backups.lock);
+  }
+  pthread_mutex_unlock(&backups.lock);
+}
+
+/// Writes what is still queued and stops the workers.
+static void stop_backups() {
+  pthread_mutex_lock(&backups.lock);
+  backups.stopping = 1;
+  pthread_cond_broadcast(&backups.queued);
+  size_t num_workers = backups.num_workers;
+  pthread_mutex_unlock(&backups.lock);
+
+  for (size_t i = 0; i < num_workers; i++) {
+    pthread_join(backups.workers[i], NULL);
+  }
+  free(backups.workers);
+  backups.workers = NULL;
+  backups.num_workers = 0;
+  backups.stopping = 0;
+}
+
+void kvs_report_backups(int fd) {
+  pthread_mutex_lock(&backups.lock);
+  unsigned long written = backups.written;
+  size_t queued = backups.num_queued;
+  size_t deepest = backups.deepest;
+  uint64_t waited_ms = backups.waited_ms;
+  uint64_t longest_wait_ms = backups.longest_wait_ms;
+  pthread_mutex_unlock(&backups.lock);
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "Backups: %lu written, %zu queued, at most %zu queued, %lu ms waited in queue, "
+           "longest %lu ms\n",
+           written, queued, deepest, (unsigned long)waited_ms, (unsigned long)longest_wait_ms);
+  write_str(fd, line);
+}
+
+void set_max_backups(int _max_backups) {
+  pthread_mutex_lock(&backups.lock);
+  backups.max = (size_t)_max_backups;
+  pthread_mutex_unlock(&backups.lock);
+}
+
+void set_backup_format(BackupFormat format) {
+  pthread_mutex_lock(&backups.lock);
+  backups.format = format;
+  pthread_mutex_unlock(&backups.lock);
+}
+
+void set_full_backup_every(size_t full_every) {
+  pthread_mutex_lock(&backups.lock);
+  backups.full_every = full_every;
+  pthread_mutex_unlock(&backups.lock);
+}
+
+void set_backup_compression(BackupCompression compression) {
+  pthread_mutex_lock(&backups.lock);
+  backups.compression = compression;
+  pthread_mutex_unlock(&backups.lock);
+}
+
+void set_backup_segments(size_t segments) {
+  pthread_mutex_lock(&backups.lock);
+  backups.segments = segments;
+  pthread_mutex_unlock(&backups.lock);
+}
+
+typedef struct {
+  const BackupSet *set;
+  atomic_uint_fast64_t next_block;
+  atomic_int failed;
+} RestoreArgs;
+
+// Restores blocks of a backup until none is left.
+static void *restore_thread(void *arg) {
+  RestoreArgs *args = arg;
+  char (*keys)[MAX_STRING_SIZE] = malloc(BACKUP_BLOCK_ENTRIES * MAX_STRING_SIZE);
+  char (*values)[MAX_STRING_SIZE] = malloc(BACKUP_BLOCK_ENTRIES * MAX_STRING_SIZE);
+  if (keys == NULL || values == NULL) {
+    atomic_store(&args->failed, 1);
+  }
+
+  while (!atomic_load(&args->failed)) {
+    uint64_t block = atomic_fetch_add(&args->next_block, 1);
+    if (block >= args->set->num_blocks) {
+      break;
+    }
+    const BackupFile *file = backup_set_block(args->set, block, &block);
+    int count = backup_read_block(file, block, keys, values);
+    if (count < 0) {
+      atomic_store(&args->failed, 1);
+      break;
+    }
+    kvs_write((size_t)count, keys, values);
+  }
+  free(keys);
+  free(values);
+  return NULL;
+}
+
+int kvs_restore(const char *path, size_t num_threads) {
+  if (!initialized) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  BackupSet set;
+  if (backup_set_open(&set, path) != 0) {
+    return 1;
+  }
+  if (set.info.kind == BACKUP_DELTA) {
+    fprintf(stderr, "Backup %s is a delta, merge its chain with kvs-compact first\n", path);
+    backup_set_close(&set);
+    return 1;
+  }
+
+  // keys are unique and blocks disjoint, so blocks, and the segments they
+  // are in, go in any order
+  RestoreArgs args = {&set, 0, 0};
+  pthread_t threads[num_threads];
+  size_t started = 0;
+  for (; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, restore_thread, &args) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    restore_thread(&args);
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  backup_set_close(&set);
+
+  if (atomic_load(&args.failed)) {
+    fprintf(stderr, "Backup %s is malformed\n", path);
+    return 1;
+  }
   return 0;
 }
 
+// Applies a batch read back from the log, before it is open for appending.
+static void replay_batch(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                         char values[][MAX_STRING_SIZE], void *arg) {
+  (void)arg;
+  size_t missing[MAX_WRITE_SIZE];
+  ShardBatch batch;
+  shard_batch(&batch, num_pairs, keys);
+  WriteRequest req = {&batch, keys, op == WAL_WRITE ? values : NULL, missing, 0, 0, 0, NULL};
+  submit_request(&req);
+}
+
+int kvs_open_wal(const char *path, unsigned int delay_ms, size_t flush_bytes) {
+  if (!initialized) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  if (wal_replay(path, replay_batch, NULL) != 0) {
+    return 1;
+  }
+  return wal_open(path, delay_ms, flush_bytes);
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
@@ -2,11 +2,33 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include "backup.h"
 #include "constants.h"
+#include "io.h"
+#include "snapshot.h"
+#include "storage.h"
+
+/// Backups of a job. Once deltas are on (set_full_backup_every), a BACKUP
+/// after the job's first one only writes what changed since its previous
+/// BACKUP. The snapshot of that backup stays pinned until the next one, so
+/// the keys changed in between keep their older values until then. A BACKUP
+/// that fails keeps the previous base, and once a worker could not write one
+/// of the chain the next BACKUP is full.
+typedef struct BackupChain BackupChain;
+
+typedef struct {
+  SnapshotHold *base_hold; // NULL until the first backup
+  BackupChain *chain;      // backups since the last full one, NULL until then
+  uint64_t base;           // snapshot of the previous backup
+  uint64_t id;             // stream of the chain, new at every full backup
+  size_t since_full;       // deltas written since the last full backup
+} BackupStream;
 
 /// Initializes the KVS state.
+/// @param num_shards Number of independent tables the keys are spread over.
+/// @param storage Backend keeping the values (see storage.h).
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(size_t num_shards, const StorageConfig *storage);
 
 int kvs_find_key(const char *key);
 
@@ -24,28 +46,67 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Output of the command, where the pairs read are added.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param out Output of the command, where the missing keys are added.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
+
+/// Reads the pairs whose keys are between two keys, in key order.
+/// @param from First key of the range.
+/// @param to Last key of the range, included.
+/// @param out Output of the command.
+/// @return 0 if the range was read successfully, 1 otherwise.
+int kvs_scan(const char *from, const char *to, OutputBuffer *out);
 
-/// Writes the state of the KVS.
+/// Reads the pairs whose keys start with a prefix, in key order.
+/// @param prefix Prefix of the keys.
+/// @param out Output of the command.
+/// @return 0 if the keys were read successfully, 1 otherwise.
+int kvs_prefix(const char *prefix, OutputBuffer *out);
+
+/// Writes the state of the KVS, sorted by key, as of when it was called.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(size_t num_backup,char* job_filename , char* directory);
+/// backup file. The state is the one at the call, the file is written
+/// later by one of max_backups workers, so the caller never waits for one.
+/// @param stream Backups of the job, zero initialized before the first one.
+/// @return 0 if the backup was queued, -1 otherwise.
+int kvs_backup(BackupStream *stream, size_t num_backup, char *job_filename, char *directory);
+
+/// Ends the backups of a job, unpinning the snapshot deltas were based on.
+/// @param stream Backups of the job.
+void kvs_end_backups(BackupStream *stream);
+
+/// Loads a binary backup into the KVS, with several threads.
+/// @param path Path of the backup, or of the manifest of its segments.
+/// @param num_threads Number of threads.
+/// @return 0 if the backup was restored, 1 otherwise.
+int kvs_restore(const char *path, size_t num_threads);
 
-/// Waits for the last backup to be called.
+/// Replays a write-ahead log on top of the current state, then logs every
+/// WRITE and DELETE to it. A WRITE or DELETE only returns once its batch is
+/// on disk, synced together with the batches of the other jobs.
+/// @param path Path of the log.
+/// @param delay_ms How long a sync waits for more batches to join it.
+/// @param flush_bytes Pending bytes after which a sync stops waiting.
+/// @return 0 on success, 1 otherwise.
+int kvs_open_wal(const char *path, unsigned int delay_ms, size_t flush_bytes);
+
+/// Waits for every backup started to be written.
 void kvs_wait_backup();
 
+/// Writes the statistics of the backup queue.
+/// @param fd File descriptor to write to.
+void kvs_report_backups(int fd);
+
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
@@ -54,6 +115,23 @@ void kvs_wait(unsigned int delay_ms);
 // @param _max_backups
 void set_max_backups(int _max_backups);
 
+// Setter for the format of the backups
+// @param format
+void set_backup_format(BackupFormat format);
+
+// Setter for how often a full backup is written, deltas in between
+// @param full_every 1 for full backups only, binary format only otherwise
+void set_full_backup_every(size_t full_every);
+
+// Setter for how the blocks of binary backups are stored
+// @param compression
+void set_backup_compression(BackupCompression compression);
+
+// Setter for how many segments a binary backup is split in, written in
+// parallel and listed by a manifest with the backup's name
+// @param segments 1 for a single file, at most MAX_BACKUP_SEGMENTS
+void set_backup_segments(size_t segments);
+
 // Setter for n_current_backups
 // @param _n_current_backups
 void set_n_current_backups(int _n_current_backups);
@@ -2,10 +2,21 @@
 
 #include "pc_buffer.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "slab.h"
+
+static SlabCache* buffer_nodes;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void createCache() {
+    buffer_nodes = slab_create("BufferNode", sizeof(BufferNode), _Alignof(BufferNode));
+}
+
 void initBuffer(Buffer* b) {
+    pthread_once(&cache_once, createCache);
     b->front = NULL;
     b->rear = NULL;
 }
@@ -15,7 +26,7 @@ int isBufferEmpty(Buffer* b) {
 }
 
 void insertInBuffer(Buffer* b, BufferData data) {
-    BufferNode* newNode = (BufferNode*)malloc(sizeof(BufferNode));
+    BufferNode* newNode = buffer_nodes ? slab_alloc(buffer_nodes) : NULL;
     if (newNode == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
@@ -44,7 +55,7 @@ BufferData removeFromBuffer(Buffer* b) {
         b->rear = NULL;
     }
 
-    free(temp);
+    slab_free(temp);
     return value;
 }
 
@@ -0,0 +1,121 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define RELEASE_BATCH 8  // slots handed back to the parser at a time
+
+struct Pipeline {
+  JobCommand slots[PIPELINE_DEPTH];
+  size_t head;            // next slot to execute, consumer only
+  size_t tail;            // next slot to decode, producer only
+  size_t released;        // slots done with but not handed back yet
+  sem_t filled;           // slots decoded and not executed yet
+  sem_t empty;            // slots the parser may decode into
+  atomic_int stop;
+  CompiledJob *job;
+  pthread_t parser;
+};
+
+// Decodes the job into free slots until EOC or until it is stopped. The
+// semaphores order the slot contents between the two threads.
+static void *parse_job(void *arg) {
+  Pipeline *pipeline = arg;
+  while (1) {
+    sem_wait(&pipeline->empty);
+    if (atomic_load(&pipeline->stop)) {
+      break;
+    }
+    JobCommand *slot = &pipeline->slots[pipeline->tail % PIPELINE_DEPTH];
+    pipeline->tail++;
+    slot->command = jobc_next(pipeline->job, slot->keys, slot->values, &slot->num_pairs,
+                              &slot->delay);
+    sem_post(&pipeline->filled);
+    if (slot->command == EOC) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+Pipeline *pipeline_create() {
+  Pipeline *pipeline = malloc(sizeof(Pipeline));
+  if (pipeline == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+    pipeline->slots[i].output = (OutputBuffer){NULL, 0, 0};
+  }
+  if (sem_init(&pipeline->filled, 0, 0) != 0) {
+    free(pipeline);
+    return NULL;
+  }
+  if (sem_init(&pipeline->empty, 0, 0) != 0) {
+    sem_destroy(&pipeline->filled);
+    free(pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+int pipeline_start(Pipeline *pipeline, CompiledJob *job) {
+  pipeline->head = 0;
+  pipeline->tail = 0;
+  pipeline->released = 0;
+  pipeline->job = job;
+  atomic_store(&pipeline->stop, 0);
+  for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+    sem_post(&pipeline->empty);
+  }
+  if (pthread_create(&pipeline->parser, NULL, parse_job, pipeline) != 0) {
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+      sem_wait(&pipeline->empty);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+JobCommand *pipeline_next(Pipeline *pipeline) {
+  // the slots released are all handed back before waiting on the parser
+  if (sem_trywait(&pipeline->filled) != 0) {
+    for (; pipeline->released > 0; pipeline->released--) {
+      sem_post(&pipeline->empty);
+    }
+    sem_wait(&pipeline->filled);
+  }
+  return &pipeline->slots[pipeline->head++ % PIPELINE_DEPTH];
+}
+
+void pipeline_release(Pipeline *pipeline) {
+  // in batches, so a parser waiting on a full ring is woken once per batch
+  // rather than once per command
+  if (++pipeline->released >= RELEASE_BATCH) {
+    for (; pipeline->released > 0; pipeline->released--) {
+      sem_post(&pipeline->empty);
+    }
+  }
+}
+
+void pipeline_stop(Pipeline *pipeline) {
+  atomic_store(&pipeline->stop, 1);
+  sem_post(&pipeline->empty); // wakes the parser if the ring is full
+  pthread_join(pipeline->parser, NULL);
+
+  // back to no slot free and none filled, for the next job
+  while (sem_trywait(&pipeline->empty) == 0) {
+  }
+  while (sem_trywait(&pipeline->filled) == 0) {
+  }
+}
+
+void pipeline_destroy(Pipeline *pipeline) {
+  for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+    output_free(&pipeline->slots[i].output);
+  }
+  sem_destroy(&pipeline->filled);
+  sem_destroy(&pipeline->empty);
+  free(pipeline);
+}
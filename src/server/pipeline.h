@@ -0,0 +1,63 @@
+#ifndef KVS_PIPELINE_H
+#define KVS_PIPELINE_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "io.h"
+#include "jobc.h"
+#include "parser.h"
+
+// Runs a job in two stages: a parser thread decodes its commands, compiling
+// the job if it has to (see jobc.h), into a bounded ring, and the thread of
+// the job executes them from there. Decoding the next commands overlaps
+// executing the current one, so a job takes about as long as the slower
+// stage. The ring has a single producer and a single consumer, and its
+// slots are allocated once and reused for every job. A slot stays with the
+// job's thread until handed back, so several commands can be executing at
+// once (see executor.h), and it keeps the result of its command until then.
+
+#define PIPELINE_DEPTH 32  // commands decoded ahead, or executing
+
+typedef struct {
+  enum Command command;
+  size_t num_pairs;    // keys of WRITE, READ, DELETE, SCAN and PREFIX
+  unsigned int delay;  // of WAIT
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  int failed;          // set by executing the command
+  OutputBuffer output; // what the command writes to the .out
+} JobCommand;
+
+typedef struct Pipeline Pipeline;
+
+/// Allocates a pipeline and its ring.
+/// @return The pipeline, NULL if it could not be allocated.
+Pipeline *pipeline_create();
+
+/// Starts decoding a job. The job must stay open until pipeline_stop.
+/// @param pipeline Pipeline not running a job.
+/// @param job Compiled job to decode.
+/// @return 0 on success, 1 if the parser thread could not be started.
+int pipeline_start(Pipeline *pipeline, CompiledJob *job);
+
+/// Waits for the next command. Must not be called while every slot is
+/// held, the parser would have nowhere to decode it.
+/// @param pipeline Running pipeline.
+/// @return The command, EOC after the last one.
+JobCommand *pipeline_next(Pipeline *pipeline);
+
+/// Hands the slot of the oldest command still held back to the parser.
+/// @param pipeline Running pipeline.
+void pipeline_release(Pipeline *pipeline);
+
+/// Stops the parser, even before it reached the end of the job, and waits
+/// for it.
+/// @param pipeline Running pipeline.
+void pipeline_stop(Pipeline *pipeline);
+
+/// Frees a pipeline that is not running a job.
+/// @param pipeline Pipeline to free.
+void pipeline_destroy(Pipeline *pipeline);
+
+#endif  // KVS_PIPELINE_H
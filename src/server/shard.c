@@ -0,0 +1,165 @@
+#include "shard.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "epoch.h"
+
+static HashTable *shards[MAX_SHARDS];
+static size_t num_shards = 0;
+static uint64_t seed;
+
+int shards_init(size_t count) {
+  if (count == 0 || count > MAX_SHARDS) {
+    fprintf(stderr, "Invalid number of shards\n");
+    return 1;
+  }
+
+  seed = new_hash_seed();
+  for (size_t i = 0; i < count; i++) {
+    shards[i] = create_hash_table();
+    if (shards[i] == NULL) {
+      num_shards = i;
+      shards_terminate();
+      return 1;
+    }
+  }
+  num_shards = count;
+  return 0;
+}
+
+void shards_terminate() {
+  epoch_terminate(); // may still free nodes into the shards' slabs
+  for (size_t i = 0; i < num_shards; i++) {
+    free_table(shards[i]);
+    shards[i] = NULL;
+  }
+  num_shards = 0;
+}
+
+size_t shards_count() {
+  return num_shards;
+}
+
+HashTable *shard_table(size_t shard) {
+  return shards[shard];
+}
+
+uint64_t shard_hash(const char *key) {
+  return hash(seed, key);
+}
+
+size_t shard_of(uint64_t h) {
+  // high bits pick the shard, the low bits pick the bucket inside it
+  return (size_t)(((h >> 32) * num_shards) >> 32);
+}
+
+void shard_batch(ShardBatch *batch, size_t num_keys, char keys[][MAX_STRING_SIZE]) {
+  size_t shard[MAX_WRITE_SIZE];
+  size_t count[MAX_SHARDS + 1] = {0};
+
+  batch->num_keys = num_keys;
+  for (size_t i = 0; i < num_keys; i++) {
+    batch->hashes[i] = shard_hash(keys[i]);
+    shard[i] = shard_of(batch->hashes[i]);
+    count[shard[i] + 1]++;
+  }
+
+  // counting sort, stable so that repeated keys keep their batch order
+  batch->num_shards = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    if (count[s + 1] > 0) {
+      batch->first[batch->num_shards] = count[s];
+      batch->shards[batch->num_shards++] = s;
+    }
+    count[s + 1] += count[s];
+  }
+  batch->first[batch->num_shards] = num_keys;
+  for (size_t i = 0; i < num_keys; i++) {
+    batch->order[count[shard[i]]++] = i;
+  }
+}
+
+void lock_batch(const ShardBatch *batch, int exclusive) {
+  for (size_t i = 0; i < batch->num_shards; i++) {
+    lock_table(shards[batch->shards[i]], exclusive);
+  }
+}
+
+void unlock_batch(const ShardBatch *batch, int exclusive) {
+  for (size_t i = batch->num_shards; i > 0; i--) {
+    unlock_table(shards[batch->shards[i - 1]], exclusive);
+  }
+}
+
+int read_batch_begin(const ShardBatch *batch, unsigned *seqs) {
+  for (size_t i = 0; i < batch->num_shards; i++) {
+    if (!read_begin(shards[batch->shards[i]], &seqs[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int read_batch_validate(const ShardBatch *batch, const unsigned *seqs) {
+  for (size_t i = 0; i < batch->num_shards; i++) {
+    if (!read_validate(shards[batch->shards[i]], seqs[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Merges the ordered indexes of the shards. With changes set, only visits
+// what differs between since and snapshot.
+static void walk(uint64_t snapshot, int changes, uint64_t since, const char *from,
+                 range_visitor visit, void *arg) {
+  KeyNode *cursors[MAX_SHARDS];
+  for (size_t s = 0; s < num_shards; s++) {
+    cursors[s] = seek_pair(shards[s], from);
+  }
+
+  while (1) {
+    // shards are few, a linear pick of the smallest key is enough
+    size_t min = num_shards;
+    for (size_t s = 0; s < num_shards; s++) {
+      if (cursors[s] != NULL &&
+          (min == num_shards ||
+           strncmp(cursors[s]->key, cursors[min]->key, MAX_STRING_SIZE - 1) < 0)) {
+        min = s;
+      }
+    }
+    if (min == num_shards) {
+      return;
+    }
+
+    KeyNode *node = cursors[min];
+    cursors[min] = next_pair(node);
+    const Version *v = version_at(node, snapshot);
+    if (changes) {
+      // versions are immutable: an unchanged key still has the same one
+      const Version *old = version_at(node, since);
+      if (v == old) {
+        continue;
+      }
+      if (v == NULL) {
+        if (visit(node->key, NULL, 0, arg) != 0) {
+          return;
+        }
+        continue;
+      }
+    }
+    if (v != NULL && visit(node->key, version_value(v), v->len, arg) != 0) {
+      return;
+    }
+  }
+}
+
+void foreach_range(uint64_t snapshot, const char *from, range_visitor visit, void *arg) {
+  walk(snapshot, 0, 0, from, visit, arg);
+}
+
+void foreach_change(uint64_t snapshot, uint64_t since, const char *from,
+                    range_visitor visit, void *arg) {
+  walk(snapshot, 1, since, from, visit, arg);
+}
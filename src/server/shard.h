@@ -0,0 +1,106 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+#define MAX_SHARDS 128
+
+// Keys of a batch grouped by shard. Shards are locked in increasing order,
+// each one once, so batches stay atomic and can never deadlock.
+typedef struct {
+  size_t num_keys;
+  uint64_t hashes[MAX_WRITE_SIZE];      // hash of each key, in batch order
+  size_t order[MAX_WRITE_SIZE];         // key indexes grouped by shard, stable
+  size_t num_shards;
+  size_t shards[MAX_WRITE_SIZE];        // distinct shards of the batch, increasing
+  size_t first[MAX_WRITE_SIZE + 1];     // order[first[i]..first[i + 1]) is in shards[i]
+} ShardBatch;
+
+/// Visitor of an ordered walk over the shards.
+/// @param key Key of the pair.
+/// @param value Value of the pair, not null terminated.
+/// @param value_len Length of the value.
+/// @param arg Argument given to foreach_range.
+/// @return Non zero to stop the walk.
+typedef int (*range_visitor)(const char *key, const char *value, int value_len, void *arg);
+
+/// Creates the shards.
+/// @param num_shards Number of independent tables, at most MAX_SHARDS.
+/// @return 0 on success, 1 otherwise.
+int shards_init(size_t num_shards);
+
+/// Frees every shard.
+void shards_terminate();
+
+/// @return Number of shards.
+size_t shards_count();
+
+/// @param shard Shard index.
+/// @return The table of the shard.
+HashTable *shard_table(size_t shard);
+
+/// Hashes a key with the seed shared by every shard.
+/// @param key Key to hash.
+/// @return The hash, used both to pick the shard and the bucket in it.
+uint64_t shard_hash(const char *key);
+
+/// @param h Hash of a key.
+/// @return Shard the key belongs to.
+size_t shard_of(uint64_t h);
+
+/// Hashes and groups the keys of a batch by shard.
+/// @param batch Batch to fill.
+/// @param num_keys Number of keys.
+/// @param keys Keys of the batch.
+void shard_batch(ShardBatch *batch, size_t num_keys, char keys[][MAX_STRING_SIZE]);
+
+/// Locks every shard of a batch, in increasing order.
+/// @param batch Batch filled by shard_batch.
+/// @param exclusive Non zero to lock for writing.
+void lock_batch(const ShardBatch *batch, int exclusive);
+
+/// Unlocks the shards locked by lock_batch.
+/// @param batch Batch given to lock_batch.
+/// @param exclusive Must match the value given to lock_batch.
+void unlock_batch(const ShardBatch *batch, int exclusive);
+
+/// Starts a lock free read of the shards of a batch (see read_begin).
+/// @param batch Batch filled by shard_batch.
+/// @param seqs Filled with the sequence of each shard of the batch.
+/// @return 1 if the read can go on, 0 if a resize is moving nodes in one.
+int read_batch_begin(const ShardBatch *batch, unsigned *seqs);
+
+/// Checks that no resize moved nodes in the shards of a batch since
+/// read_batch_begin.
+/// @param batch Batch given to read_batch_begin.
+/// @param seqs Sequences filled by read_batch_begin.
+/// @return 1 if the lookups are right, 0 otherwise.
+int read_batch_validate(const ShardBatch *batch, const unsigned *seqs);
+
+/// Visits the pairs of every shard as they are in a snapshot, in key order,
+/// starting at the first key that is not smaller than from. The shards'
+/// ordered indexes are merged, so the walk costs a seek per shard and then
+/// only the keys visited.
+/// Takes no lock, the caller must be in an epoch.
+/// @param snapshot Pinned snapshot (see snapshot.h).
+/// @param from Smallest key to visit, NULL to start at the first one.
+/// @param visit Visitor, called until it returns non zero.
+/// @param arg Argument passed to the visitor.
+void foreach_range(uint64_t snapshot, const char *from, range_visitor visit, void *arg);
+
+/// Like foreach_range, but only visits the pairs whose value in the snapshot
+/// is not the one they had in an older snapshot. Keys deleted in between are
+/// visited with a NULL value.
+/// @param snapshot Pinned snapshot.
+/// @param since Older pinned snapshot.
+/// @param from Smallest key to visit, NULL to start at the first one.
+/// @param visit Visitor, called until it returns non zero.
+/// @param arg Argument passed to the visitor.
+void foreach_change(uint64_t snapshot, uint64_t since, const char *from,
+                    range_visitor visit, void *arg);
+
+#endif  // KVS_SHARD_H
@@ -0,0 +1,280 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io.h"
+
+// Header at the start of every slab, the objects follow it.
+typedef struct Slab {
+  SlabCache *cache;
+  struct Slab *next;
+} Slab;
+
+struct SlabCache {
+  const char *name;
+  size_t object_size;
+  size_t first_offset;     // offset of the first object in a slab
+  size_t objects_per_slab;
+  unsigned id;             // index in the registry and in the thread caches
+  atomic_uint generation;  // bumped by slab_release_all, invalidates thread lists
+
+  pthread_mutex_t lock;    // guards everything below
+  Slab *slabs;
+  size_t num_slabs;
+  void *free_list;         // free objects, linked through their first word
+  size_t num_free;
+};
+
+// Free objects a thread keeps for one cache.
+typedef struct {
+  SlabCache *cache;
+  unsigned generation;
+  void *head;
+  size_t count;
+} LocalCache;
+
+static _Atomic(SlabCache *) caches[MAX_SLAB_CACHES];
+static atomic_uint next_id = 0;
+
+static _Thread_local LocalCache locals[MAX_SLAB_CACHES];
+static pthread_once_t flush_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t flush_key;
+
+static void *next_of(void *object) {
+  return *(void **)object;
+}
+
+static void set_next(void *object, void *next) {
+  *(void **)object = next;
+}
+
+// Gives count objects of a thread list back to the cache, under one lock.
+static void flush_local(LocalCache *local, size_t count) {
+  SlabCache *cache = local->cache;
+  void *first = local->head;
+  void *last = first;
+  for (size_t i = 1; i < count; i++) {
+    last = next_of(last);
+  }
+  local->head = next_of(last);
+  local->count -= count;
+
+  pthread_mutex_lock(&cache->lock);
+  set_next(last, cache->free_list);
+  cache->free_list = first;
+  cache->num_free += count;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Thread exit: hand every thread list back to its cache.
+static void flush_all_locals(void *arg) {
+  (void)arg;
+  for (unsigned id = 0; id < MAX_SLAB_CACHES; id++) {
+    LocalCache *local = &locals[id];
+    if (local->count == 0 || atomic_load(&caches[id]) != local->cache ||
+        atomic_load(&local->cache->generation) != local->generation) {
+      continue;
+    }
+    flush_local(local, local->count);
+  }
+}
+
+static void create_flush_key() {
+  pthread_key_create(&flush_key, flush_all_locals);
+}
+
+static LocalCache *local_cache(SlabCache *cache) {
+  LocalCache *local = &locals[cache->id];
+  unsigned generation = atomic_load_explicit(&cache->generation, memory_order_acquire);
+  if (local->cache != cache || local->generation != generation) {
+    if (local->cache == NULL) {
+      // the destructor only runs when the key has a non NULL value
+      pthread_once(&flush_key_once, create_flush_key);
+      pthread_setspecific(flush_key, locals);
+    }
+    // objects of an older generation belong to slabs that no longer exist
+    local->cache = cache;
+    local->generation = generation;
+    local->head = NULL;
+    local->count = 0;
+  }
+  return local;
+}
+
+// Adds a new slab to the cache's free list. The cache's lock must be held.
+static int grow(SlabCache *cache) {
+  Slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+  if (slab == NULL) {
+    return 1;
+  }
+  slab->cache = cache;
+  slab->next = cache->slabs;
+  cache->slabs = slab;
+  cache->num_slabs++;
+
+  char *object = (char *)slab + cache->first_offset;
+  for (size_t i = 0; i < cache->objects_per_slab; i++, object += cache->object_size) {
+    set_next(object, cache->free_list);
+    cache->free_list = object;
+  }
+  cache->num_free += cache->objects_per_slab;
+  return 0;
+}
+
+SlabCache *slab_create(const char *name, size_t object_size, size_t align) {
+  unsigned id = atomic_fetch_add(&next_id, 1);
+  if (id >= MAX_SLAB_CACHES) {
+    fprintf(stderr, "Too many slab caches\n");
+    return NULL;
+  }
+
+  SlabCache *cache = malloc(sizeof(SlabCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  if (object_size < sizeof(void *)) {
+    object_size = sizeof(void *);
+  }
+  cache->name = name;
+  cache->object_size = (object_size + align - 1) & ~(align - 1);
+  cache->first_offset = (sizeof(Slab) + align - 1) & ~(align - 1);
+  cache->objects_per_slab = (SLAB_SIZE - cache->first_offset) / cache->object_size;
+  cache->id = id;
+  atomic_init(&cache->generation, 0);
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->slabs = NULL;
+  cache->num_slabs = 0;
+  cache->free_list = NULL;
+  cache->num_free = 0;
+
+  atomic_store(&caches[id], cache);
+  return cache;
+}
+
+void *slab_alloc(SlabCache *cache) {
+  LocalCache *local = local_cache(cache);
+
+  if (local->head == NULL) {
+    // refill the thread list with a batch taken from the cache
+    pthread_mutex_lock(&cache->lock);
+    if (cache->free_list == NULL && grow(cache) != 0) {
+      pthread_mutex_unlock(&cache->lock);
+      return NULL;
+    }
+    void *last = cache->free_list;
+    size_t count = 1;
+    while (count < SLAB_BATCH && next_of(last) != NULL) {
+      last = next_of(last);
+      count++;
+    }
+    local->head = cache->free_list;
+    cache->free_list = next_of(last);
+    cache->num_free -= count;
+    pthread_mutex_unlock(&cache->lock);
+    set_next(last, NULL);
+    local->count = count;
+  }
+
+  void *object = local->head;
+  local->head = next_of(object);
+  local->count--;
+  return object;
+}
+
+void slab_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  Slab *slab = (Slab *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+  LocalCache *local = local_cache(slab->cache);
+
+  set_next(ptr, local->head);
+  local->head = ptr;
+  if (++local->count >= 2 * SLAB_BATCH) {
+    flush_local(local, SLAB_BATCH);
+  }
+}
+
+void slab_release_all(SlabCache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  Slab *slab = cache->slabs;
+  while (slab != NULL) {
+    Slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  cache->slabs = NULL;
+  cache->num_slabs = 0;
+  cache->free_list = NULL;
+  cache->num_free = 0;
+  atomic_fetch_add_explicit(&cache->generation, 1, memory_order_release);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void slab_destroy(SlabCache *cache) {
+  atomic_store(&caches[cache->id], NULL);
+  slab_release_all(cache);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+void slab_stats(SlabCache *cache, SlabStats *stats) {
+  pthread_mutex_lock(&cache->lock);
+  stats->name = cache->name;
+  stats->object_size = cache->object_size;
+  stats->slabs = cache->num_slabs;
+  stats->reserved = cache->num_slabs * SLAB_SIZE;
+  stats->allocated = cache->num_slabs * cache->objects_per_slab - cache->num_free;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void slab_report(int fd) {
+  unsigned num_caches = atomic_load(&next_id);
+  if (num_caches > MAX_SLAB_CACHES) {
+    num_caches = MAX_SLAB_CACHES;
+  }
+
+  // caches sharing a name (one per shard, for instance) are reported together
+  for (unsigned id = 0; id < num_caches; id++) {
+    SlabCache *cache = atomic_load(&caches[id]);
+    if (cache == NULL) {
+      continue;
+    }
+    int reported = 0;
+    for (unsigned prev = 0; prev < id && !reported; prev++) {
+      SlabCache *other = atomic_load(&caches[prev]);
+      reported = other != NULL && strcmp(other->name, cache->name) == 0;
+    }
+    if (reported) {
+      continue;
+    }
+
+    SlabStats total;
+    slab_stats(cache, &total);
+    size_t count = 1;
+    for (unsigned next = id + 1; next < num_caches; next++) {
+      SlabCache *other = atomic_load(&caches[next]);
+      if (other == NULL || strcmp(other->name, cache->name) != 0) {
+        continue;
+      }
+      SlabStats stats;
+      slab_stats(other, &stats);
+      total.slabs += stats.slabs;
+      total.reserved += stats.reserved;
+      total.allocated += stats.allocated;
+      count++;
+    }
+
+    char line[192];
+    snprintf(line, sizeof(line),
+             "%s: %zu bytes in %zu slabs of %zu caches, %zu objects of %zu bytes (%zu bytes) allocated\n",
+             total.name, total.reserved, total.slabs, count, total.allocated, total.object_size,
+             total.allocated * total.object_size);
+    write_str(fd, line);
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_SIZE (64 * 1024) // bytes per slab, slabs are aligned to their size
+#define SLAB_BATCH 32         // objects moved at once between a thread and its cache
+#define MAX_SLAB_CACHES 512
+
+// Allocator for objects of a single fixed size. Objects are carved from
+// SLAB_SIZE blocks; each thread keeps a small list of free objects per cache
+// and only takes the cache's lock to move SLAB_BATCH of them at a time.
+typedef struct SlabCache SlabCache;
+
+typedef struct {
+  const char *name;
+  size_t object_size;
+  size_t slabs;        // number of slabs owned by the cache
+  size_t reserved;     // bytes held by those slabs
+  size_t allocated;    // objects handed out, including the ones in thread lists
+} SlabStats;
+
+/// Creates a cache of objects.
+/// @param name Name shown in the reports, must outlive the cache.
+/// @param object_size Size of each object.
+/// @param align Alignment of each object, a power of two.
+/// @return The new cache, NULL on failure.
+SlabCache *slab_create(const char *name, size_t object_size, size_t align);
+
+/// Allocates an object.
+/// @param cache Cache to allocate from.
+/// @return The object, NULL if out of memory.
+void *slab_alloc(SlabCache *cache);
+
+/// Frees an object allocated by slab_alloc. The owning cache is found from
+/// the address, so this can be used as an epoch retire function.
+/// @param ptr Object to free.
+void slab_free(void *ptr);
+
+/// Frees every slab of a cache at once, without visiting the objects. No
+/// object of the cache may be reachable anymore, and no other thread may be
+/// using the cache meanwhile.
+/// @param cache Cache to empty.
+void slab_release_all(SlabCache *cache);
+
+/// Releases every slab and the cache itself.
+/// @param cache Cache to destroy.
+void slab_destroy(SlabCache *cache);
+
+/// Fills the memory usage of a cache.
+/// @param cache Cache to inspect.
+/// @param stats Where to store the usage.
+void slab_stats(SlabCache *cache, SlabStats *stats);
+
+/// Writes the memory usage of every cache, one line per cache.
+/// @param fd File descriptor to write to.
+void slab_report(int fd);
+
+#endif  // KVS_SLAB_H
@@ -0,0 +1,149 @@
+#include "snapshot.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NOT_PINNED UINT64_MAX
+
+// One record per thread, kept in a global list that only grows. Records of
+// threads that exited are reused by new threads.
+typedef struct SnapshotRecord {
+  _Alignas(64) atomic_uint_fast64_t pinned; // NOT_PINNED when idle
+  atomic_int in_use;
+  int nesting;
+  struct SnapshotRecord *next;
+} SnapshotRecord;
+
+static atomic_uint_fast64_t next_version = 0; // last version handed out
+static atomic_uint_fast64_t visible = 0;      // last version committed
+// Highest horizon a writer announced: snapshots below it may already be
+// missing values, so pinning one is retried.
+static atomic_uint_fast64_t floor_version = 0;
+
+static _Atomic(SnapshotRecord *) records = NULL;
+
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static _Thread_local SnapshotRecord *self = NULL;
+
+// Thread exit: the record can be taken by another thread.
+static void release_record(void *arg) {
+  SnapshotRecord *record = arg;
+  record->nesting = 0;
+  atomic_store(&record->pinned, NOT_PINNED);
+  atomic_store(&record->in_use, 0);
+}
+
+static void create_record_key() {
+  pthread_key_create(&record_key, release_record);
+}
+
+// Takes a free record, or adds a new one to the list.
+static SnapshotRecord *acquire_record() {
+  for (SnapshotRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+      return r;
+    }
+  }
+
+  SnapshotRecord *r = aligned_alloc(_Alignof(SnapshotRecord), sizeof(SnapshotRecord));
+  if (r == NULL) {
+    perror("Failed to allocate snapshot record");
+    exit(EXIT_FAILURE);
+  }
+  atomic_init(&r->pinned, NOT_PINNED);
+  atomic_init(&r->in_use, 1);
+  r->nesting = 0;
+  r->next = atomic_load(&records);
+  while (!atomic_compare_exchange_weak(&records, &r->next, r))
+    ;
+  return r;
+}
+
+static SnapshotRecord *get_record() {
+  if (self != NULL) {
+    return self;
+  }
+  pthread_once(&record_key_once, create_record_key);
+  self = acquire_record();
+  pthread_setspecific(record_key, self);
+  return self;
+}
+
+// Pins the visible snapshot in an unpinned record.
+static uint64_t pin_visible(SnapshotRecord *r) {
+  // the pin is published before the floor is checked, and writers raise the
+  // floor before looking at the pins: either they see this pin or it sees
+  // their floor and takes a newer snapshot
+  uint64_t version;
+  do {
+    version = atomic_load(&visible);
+    atomic_store(&r->pinned, version);
+  } while (atomic_load(&floor_version) > version);
+  return version;
+}
+
+uint64_t snapshot_begin_commit() {
+  return atomic_fetch_add(&next_version, 1) + 1;
+}
+
+void snapshot_commit(uint64_t version) {
+  // the batches before it already hold their locks, they will not be long
+  while (atomic_load_explicit(&visible, memory_order_acquire) != version - 1) {
+    sched_yield();
+  }
+  atomic_store_explicit(&visible, version, memory_order_release);
+}
+
+uint64_t snapshot_pin() {
+  SnapshotRecord *r = get_record();
+  if (r->nesting++ > 0) {
+    return atomic_load_explicit(&r->pinned, memory_order_relaxed);
+  }
+  return pin_visible(r);
+}
+
+void snapshot_unpin() {
+  SnapshotRecord *r = get_record();
+  if (--r->nesting == 0) {
+    atomic_store_explicit(&r->pinned, NOT_PINNED, memory_order_release);
+  }
+}
+
+SnapshotHold *snapshot_hold(uint64_t *snapshot) {
+  SnapshotRecord *r = acquire_record();
+  *snapshot = pin_visible(r);
+  return r;
+}
+
+SnapshotHold *snapshot_hold_at(uint64_t snapshot) {
+  // the existing pin keeps the horizon at or below the snapshot, so there is
+  // no floor to check
+  SnapshotRecord *r = acquire_record();
+  atomic_store(&r->pinned, snapshot);
+  return r;
+}
+
+void snapshot_release(SnapshotHold *hold) {
+  atomic_store_explicit(&hold->pinned, NOT_PINNED, memory_order_release);
+  atomic_store(&hold->in_use, 0);
+}
+
+uint64_t snapshot_horizon() {
+  uint64_t horizon = atomic_load(&visible);
+  uint64_t floor = atomic_load(&floor_version);
+  while (floor < horizon && !atomic_compare_exchange_weak(&floor_version, &floor, horizon))
+    ;
+
+  for (SnapshotRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+    uint64_t pinned = atomic_load(&r->pinned);
+    if (pinned < horizon) {
+      horizon = pinned;
+    }
+  }
+  return horizon;
+}
@@ -0,0 +1,52 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stdint.h>
+
+// Multi version concurrency control. Every WRITE or DELETE batch commits
+// with a version from a global sequence, and every value it writes carries
+// that version. Batches become visible in version order, so a snapshot, the
+// last visible version, sees every batch up to it and nothing after it.
+// Readers pin a snapshot and read the newest value not newer than it,
+// without locks; writers only drop old values no snapshot can still read.
+
+/// Gives the version of a batch about to commit. The batch must then be
+/// published with snapshot_commit, with the keys it writes locked until then.
+/// @return The batch's version.
+uint64_t snapshot_begin_commit();
+
+/// Makes a batch visible, once every batch with a smaller version is.
+/// @param version Version given by snapshot_begin_commit.
+void snapshot_commit(uint64_t version);
+
+/// Pins the current snapshot for this thread. Pins may be nested, the inner
+/// ones get the outer snapshot.
+/// @return The snapshot: the last version that was visible.
+uint64_t snapshot_pin();
+
+/// Unpins the snapshot pinned by snapshot_pin.
+void snapshot_unpin();
+
+/// A snapshot pinned apart from any thread, for work handed to another one.
+typedef struct SnapshotRecord SnapshotHold;
+
+/// Pins the current snapshot until snapshot_release, whatever thread calls it.
+/// @param snapshot Filled with the snapshot.
+/// @return The pin.
+SnapshotHold *snapshot_hold(uint64_t *snapshot);
+
+/// Pins again a snapshot that is already pinned, until snapshot_release.
+/// @param snapshot The snapshot, pinned by a thread or a hold until this returns.
+/// @return The pin.
+SnapshotHold *snapshot_hold_at(uint64_t snapshot);
+
+/// Unpins a snapshot pinned by snapshot_hold or snapshot_hold_at.
+/// @param hold The pin.
+void snapshot_release(SnapshotHold *hold);
+
+/// Finds the oldest snapshot that is, or can still be, pinned. Values older
+/// than the newest value at or below it can be dropped.
+/// @return The version.
+uint64_t snapshot_horizon();
+
+#endif  // KVS_SNAPSHOT_H
@@ -0,0 +1,421 @@
+#include "storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "epoch.h"
+#include "io.h"
+#include "kvs.h"
+#include "shard.h"
+
+#define MAX_SEGMENTS 4096
+#define SEGMENT_PREFIX "segment-"
+#define RECORD_HEADER_SIZE 2 // key length and value length
+#define COMPACT_MS 1000      // the compactor looks at the segments this often
+#define COMPACT_LIVE_PERCENT 50 // sealed segments with fewer live records are compacted
+
+// A segment file, mapped whole. Records are a u8 key length, a u8 value
+// length, the key and the value, appended until the next one does not fit.
+typedef struct {
+  unsigned char *map;
+  int fd;
+  size_t used;          // bytes appended
+  size_t records;       // records appended
+  atomic_size_t live;   // records some version still points to
+  int sealed;           // no more appends, a newer segment took over
+  int compacted;        // its live records were moved, it only waits for readers
+} Segment;
+
+// What a bitcask version keeps in its slot.
+typedef struct {
+  uint32_t segment;
+  uint32_t offset; // of the value
+} Location;
+
+static struct {
+  pthread_mutex_t lock;  // appends and the segment table
+  pthread_cond_t wake;   // stopping, or a segment was sealed
+  StorageConfig config;
+  _Atomic(Segment *) segments[MAX_SEGMENTS];
+  Segment *active;
+  uint32_t active_index;
+  pthread_t thread;
+  int running;
+  int stopping;
+  unsigned long compacted;  // segments whose live records were moved
+  unsigned long moved;      // records moved by compaction
+  unsigned long deleted;    // segments deleted
+} storage = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {STORAGE_MEMORY, NULL, 0},
+             {NULL}, NULL, 0, 0, 0, 0, 0, 0, 0};
+
+static void segment_path(char *path, size_t size, uint32_t index) {
+  snprintf(path, size, "%s/" SEGMENT_PREFIX "%04u.kvs", storage.config.directory,
+           (unsigned)index);
+}
+
+// Deletes the segments an earlier run left behind.
+static void remove_old() {
+  DIR *dir = opendir(storage.config.directory);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) == 0) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", storage.config.directory, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+// Creates and maps the file of a new segment. Called with the lock held.
+// @return The segment, NULL on failure.
+static Segment *create_segment(uint32_t index) {
+  char path[PATH_MAX];
+  segment_path(path, sizeof(path), index);
+  Segment *segment = malloc(sizeof(Segment));
+  if (segment == NULL) {
+    return NULL;
+  }
+  segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (segment->fd < 0) {
+    free(segment);
+    return NULL;
+  }
+  // the blocks are taken up front: a store into a page of a sparse file the
+  // disk has no room for raises SIGBUS, a full disk has to fail here instead
+  segment->map = MAP_FAILED;
+  if (posix_fallocate(segment->fd, 0, (off_t)storage.config.segment_bytes) == 0) {
+    segment->map = mmap(NULL, storage.config.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        segment->fd, 0);
+  }
+  if (segment->map == MAP_FAILED) {
+    close(segment->fd);
+    unlink(path);
+    free(segment);
+    return NULL;
+  }
+  // values are read one at a time, read ahead would only fill the cache
+  posix_madvise(segment->map, storage.config.segment_bytes, POSIX_MADV_RANDOM);
+  segment->used = 0;
+  segment->records = 0;
+  atomic_init(&segment->live, 0);
+  segment->sealed = 0;
+  segment->compacted = 0;
+  return segment;
+}
+
+static void delete_segment(Segment *segment, uint32_t index) {
+  char path[PATH_MAX];
+  segment_path(path, sizeof(path), index);
+  munmap(segment->map, storage.config.segment_bytes);
+  close(segment->fd);
+  unlink(path);
+  free(segment);
+}
+
+// Seals the active segment and makes a new one active, in the first free
+// slot of the table. Called with the lock held.
+// @return 0 on success, 1 if there is no room or the file can not be made.
+static int next_segment() {
+  uint32_t index = 0;
+  while (index < MAX_SEGMENTS && atomic_load_explicit(&storage.segments[index],
+                                                      memory_order_relaxed) != NULL) {
+    index++;
+  }
+  if (index == MAX_SEGMENTS) {
+    return 1;
+  }
+  Segment *segment = create_segment(index);
+  if (segment == NULL) {
+    return 1;
+  }
+  if (storage.active != NULL) {
+    storage.active->sealed = 1;
+    pthread_cond_signal(&storage.wake);
+  }
+  atomic_store_explicit(&storage.segments[index], segment, memory_order_release);
+  storage.active = segment;
+  storage.active_index = index;
+  return 0;
+}
+
+// Moves the live records of a sealed segment to the active one. The
+// versions that pointed to them are replaced, and once readers let go of
+// them, the segment has no live record left and is deleted.
+static void compact_segment(Segment *segment, uint32_t index) {
+  unsigned long moved = 0;
+  size_t records = 0;
+  size_t offset = 0;
+  while (offset + RECORD_HEADER_SIZE <= segment->used) {
+    size_t key_len = segment->map[offset];
+    size_t value_len = segment->map[offset + 1];
+    char key[MAX_STRING_SIZE];
+    memcpy(key, segment->map + offset + RECORD_HEADER_SIZE, key_len);
+    key[key_len] = '\0';
+    Location location = {index, (uint32_t)(offset + RECORD_HEADER_SIZE + key_len)};
+    offset += RECORD_HEADER_SIZE + key_len + value_len;
+
+    uint64_t h = shard_hash(key);
+    HashTable *table = shard_table(shard_of(h));
+    lock_table(table, 1);
+    moved += (unsigned long)relocate_value(table, h, key, &location);
+    unlock_table(table, 1);
+
+    // a segment holds many records, stopping does not wait for all of them
+    if (++records % 256 == 0) {
+      pthread_mutex_lock(&storage.lock);
+      int stopping = storage.stopping;
+      pthread_mutex_unlock(&storage.lock);
+      if (stopping) {
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&storage.lock);
+  storage.compacted++;
+  storage.moved += moved;
+  pthread_mutex_unlock(&storage.lock);
+}
+
+// Deletes the sealed segments nothing points to and picks the emptiest one
+// under COMPACT_LIVE_PERCENT. Called with the lock held.
+// @return Index of the segment to compact, MAX_SEGMENTS if there is none.
+static uint32_t sweep_segments() {
+  uint32_t candidate = MAX_SEGMENTS;
+  size_t candidate_live = 0;
+  for (uint32_t i = 0; i < MAX_SEGMENTS; i++) {
+    Segment *segment = atomic_load_explicit(&storage.segments[i], memory_order_relaxed);
+    if (segment == NULL || !segment->sealed) {
+      continue;
+    }
+    // live only drops once no reader can reach a version of the segment
+    size_t live = atomic_load(&segment->live);
+    if (live == 0) {
+      atomic_store_explicit(&storage.segments[i], NULL, memory_order_relaxed);
+      delete_segment(segment, i);
+      storage.deleted++;
+    } else if (!segment->compacted &&
+               live * 100 < segment->records * COMPACT_LIVE_PERCENT &&
+               (candidate == MAX_SEGMENTS || live < candidate_live)) {
+      candidate = i;
+      candidate_live = live;
+    }
+  }
+  return candidate;
+}
+
+static void wait_for(uint64_t wait_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)(wait_ms / 1000);
+  deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&storage.wake, &storage.lock, &deadline);
+}
+
+static void *compaction_thread(void *arg) {
+  (void)arg;
+  // signals are left to the main thread, like in the job threads
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&storage.lock);
+  while (!storage.stopping) {
+    uint32_t index = sweep_segments();
+    if (index == MAX_SEGMENTS) {
+      wait_for(COMPACT_MS);
+      continue;
+    }
+    // the segment is sealed and only this thread deletes segments, it stays
+    // put without the lock
+    Segment *segment = atomic_load_explicit(&storage.segments[index], memory_order_relaxed);
+    segment->compacted = 1;
+    pthread_mutex_unlock(&storage.lock);
+    compact_segment(segment, index);
+    // the replaced versions are only released once collected
+    epoch_collect();
+    pthread_mutex_lock(&storage.lock);
+    if (!storage.stopping) {
+      wait_for(COMPACT_MS);
+    }
+  }
+  pthread_mutex_unlock(&storage.lock);
+  return NULL;
+}
+
+int storage_init(const StorageConfig *config) {
+  storage.config = *config;
+  if (config->kind == STORAGE_MEMORY) {
+    return 0;
+  }
+  if (config->segment_bytes < MAX_STRING_SIZE * 2 + RECORD_HEADER_SIZE ||
+      config->segment_bytes > UINT32_MAX) {
+    fprintf(stderr, "Invalid segment size\n");
+    return 1;
+  }
+  if (mkdir(config->directory, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create storage directory %s\n", config->directory);
+    return 1;
+  }
+  remove_old();
+
+  pthread_mutex_lock(&storage.lock);
+  int failed = next_segment();
+  storage.stopping = 0;
+  int err = failed ? 0 : pthread_create(&storage.thread, NULL, compaction_thread, NULL);
+  storage.running = !failed && err == 0;
+  pthread_mutex_unlock(&storage.lock);
+  if (failed || err != 0) {
+    fprintf(stderr, "Failed to start the bitcask storage in %s\n", config->directory);
+    storage_terminate();
+    return 1;
+  }
+  return 0;
+}
+
+size_t storage_slot_size() {
+  return storage.config.kind == STORAGE_MEMORY ? MAX_STRING_SIZE : sizeof(Location);
+}
+
+int storage_put(const char *key, const char *value, size_t len, void *slot) {
+  if (storage.config.kind == STORAGE_MEMORY) {
+    memcpy(slot, value, len);
+    ((char *)slot)[len] = '\0';
+    return 0;
+  }
+  Location location = {0, 0};
+  if (len == 0) {
+    memcpy(slot, &location, sizeof(location)); // nothing to keep
+    return 0;
+  }
+
+  size_t key_len = strnlen(key, MAX_STRING_SIZE - 1);
+  size_t size = RECORD_HEADER_SIZE + key_len + len;
+  pthread_mutex_lock(&storage.lock);
+  if (storage.active->used + size > storage.config.segment_bytes && next_segment() != 0) {
+    pthread_mutex_unlock(&storage.lock);
+    return 1;
+  }
+  Segment *segment = storage.active;
+  unsigned char *record = segment->map + segment->used;
+  record[0] = (unsigned char)key_len;
+  record[1] = (unsigned char)len;
+  memcpy(record + RECORD_HEADER_SIZE, key, key_len);
+  memcpy(record + RECORD_HEADER_SIZE + key_len, value, len);
+  location.segment = storage.active_index;
+  location.offset = (uint32_t)(segment->used + RECORD_HEADER_SIZE + key_len);
+  segment->used += size;
+  segment->records++;
+  atomic_fetch_add(&segment->live, 1);
+  pthread_mutex_unlock(&storage.lock);
+
+  memcpy(slot, &location, sizeof(location));
+  return 0;
+}
+
+const char *storage_get(const void *slot, size_t len) {
+  if (storage.config.kind == STORAGE_MEMORY) {
+    return slot;
+  }
+  if (len == 0) {
+    return "";
+  }
+  Location location;
+  memcpy(&location, slot, sizeof(location));
+  Segment *segment = atomic_load_explicit(&storage.segments[location.segment],
+                                          memory_order_acquire);
+  return (const char *)segment->map + location.offset;
+}
+
+void storage_release(const void *slot, size_t len) {
+  if (storage.config.kind == STORAGE_MEMORY || len == 0) {
+    return;
+  }
+  Location location;
+  memcpy(&location, slot, sizeof(location));
+  Segment *segment = atomic_load_explicit(&storage.segments[location.segment],
+                                          memory_order_acquire);
+  atomic_fetch_sub(&segment->live, 1);
+}
+
+void storage_stop() {
+  pthread_mutex_lock(&storage.lock);
+  int running = storage.running;
+  storage.stopping = 1;
+  storage.running = 0;
+  pthread_cond_signal(&storage.wake);
+  pthread_mutex_unlock(&storage.lock);
+  if (running) {
+    pthread_join(storage.thread, NULL);
+  }
+}
+
+void storage_terminate() {
+  storage_stop();
+  pthread_mutex_lock(&storage.lock);
+  for (uint32_t i = 0; i < MAX_SEGMENTS; i++) {
+    Segment *segment = atomic_load_explicit(&storage.segments[i], memory_order_relaxed);
+    if (segment != NULL) {
+      atomic_store_explicit(&storage.segments[i], NULL, memory_order_relaxed);
+      delete_segment(segment, i);
+    }
+  }
+  storage.active = NULL;
+  pthread_mutex_unlock(&storage.lock);
+}
+
+void storage_report(int fd) {
+  if (storage.config.kind == STORAGE_MEMORY) {
+    return;
+  }
+  size_t num_segments = 0;
+  uint64_t used = 0;
+  uint64_t records = 0;
+  uint64_t live = 0;
+  pthread_mutex_lock(&storage.lock);
+  for (uint32_t i = 0; i < MAX_SEGMENTS; i++) {
+    Segment *segment = atomic_load_explicit(&storage.segments[i], memory_order_relaxed);
+    if (segment != NULL) {
+      num_segments++;
+      used += segment->used;
+      records += segment->records;
+      live += atomic_load(&segment->live);
+    }
+  }
+  unsigned long compacted = storage.compacted;
+  unsigned long moved = storage.moved;
+  unsigned long deleted = storage.deleted;
+  pthread_mutex_unlock(&storage.lock);
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "Bitcask storage: %lu segments, %lu bytes, %lu records, %lu live, "
+           "%lu compacted, %lu records moved, %lu segments deleted\n",
+           (unsigned long)num_segments, (unsigned long)used, (unsigned long)records,
+           (unsigned long)live, compacted, moved, deleted);
+  write_str(fd, line);
+}
@@ -0,0 +1,70 @@
+#ifndef KVS_STORAGE_H
+#define KVS_STORAGE_H
+
+#include <stddef.h>
+
+// Where the values of the versions live (see kvs.h). Every Version ends with
+// a slot of storage_slot_size bytes that the backend fills:
+// - STORAGE_MEMORY keeps the value itself in the slot, as it always was.
+// - STORAGE_BITCASK appends each value, with its key, to the active segment
+//   file and only keeps the segment and offset in the slot. Segments are
+//   mapped, so values are read straight from the page cache and the kernel
+//   can write cold ones out and drop them. Keys stay in memory, in the hash
+//   chains and the ordered index, which act as Bitcask's key directory.
+//   A background thread copies the values still used out of segments that
+//   are mostly dead, and deletes the segments nothing points to anymore.
+// Segments only hold the values of the running server: durability stays
+// with the log and the checkpoints, so the segments of an earlier run are
+// deleted at startup.
+
+typedef enum {
+  STORAGE_MEMORY,
+  STORAGE_BITCASK,
+} StorageKind;
+
+typedef struct {
+  StorageKind kind;
+  const char *directory; // segment files, bitcask only
+  size_t segment_bytes;  // size of a segment file, bitcask only
+} StorageConfig;
+
+/// Sets the backend up, before any table is created. Starts the compaction
+/// thread of the bitcask backend.
+/// @param config Backend to use, copied.
+/// @return 0 on success, 1 otherwise.
+int storage_init(const StorageConfig *config);
+
+/// @return Size of the slot a Version keeps its value in.
+size_t storage_slot_size();
+
+/// Stores the value of a new version.
+/// @param key Key of the pair, only written with the value by bitcask.
+/// @param value Value, len bytes.
+/// @param len Length of the value, at most MAX_STRING_SIZE - 1.
+/// @param slot Slot of the version, filled.
+/// @return 0 on success, 1 if the value could not be stored.
+int storage_put(const char *key, const char *value, size_t len, void *slot);
+
+/// Reads the value of a version. Only valid while the version can be read,
+/// so inside an epoch or with its table locked.
+/// @param slot Slot filled by storage_put.
+/// @param len Length of the value.
+/// @return The value, not null terminated.
+const char *storage_get(const void *slot, size_t len);
+
+/// Drops the value of a version that no reader can reach anymore.
+/// @param slot Slot filled by storage_put.
+/// @param len Length of the value.
+void storage_release(const void *slot, size_t len);
+
+/// Stops the compaction thread, before the tables are freed.
+void storage_stop();
+
+/// Deletes the segments, once the tables are gone.
+void storage_terminate();
+
+/// Writes the statistics of the segments, with the bitcask backend.
+/// @param fd File descriptor to write to.
+void storage_report(int fd);
+
+#endif  // KVS_STORAGE_H
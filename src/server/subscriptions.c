@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include "slab.h"
+
 typedef struct {
     OuterNode* node;
     pthread_mutex_t mutex;
@@ -13,8 +15,24 @@ typedef struct {
 
 SubscriptionsHead subscriptions_head = {NULL, PTHREAD_MUTEX_INITIALIZER};
 
+static SlabCache* inner_nodes;
+static SlabCache* outer_nodes;
+static SlabCache* inner_copies; // lists handed out by findKey, outlive cleanups
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+
+static void createCaches() {
+    inner_nodes = slab_create("InnerNode", sizeof(InnerNode), _Alignof(InnerNode));
+    outer_nodes = slab_create("OuterNode", sizeof(OuterNode), _Alignof(OuterNode));
+    inner_copies = slab_create("InnerNode copy", sizeof(InnerNode), _Alignof(InnerNode));
+    if (!inner_nodes || !outer_nodes || !inner_copies) {
+        perror("Failed to create subscription caches");
+        exit(EXIT_FAILURE);
+    }
+}
+
 InnerNode* createInnerNode(int notification_pipe) {
-    InnerNode* newNode = (InnerNode*)malloc(sizeof(InnerNode));
+    pthread_once(&caches_once, createCaches);
+    InnerNode* newNode = slab_alloc(inner_nodes);
     if (!newNode) {
         perror("Failed to allocate memory for inner node");
         exit(EXIT_FAILURE);
@@ -25,17 +43,14 @@ InnerNode* createInnerNode(int notification_pipe) {
 }
 
 OuterNode* createOuterNode(char* key) {
-    OuterNode* newNode = (OuterNode*)malloc(sizeof(OuterNode));
+    pthread_once(&caches_once, createCaches);
+    OuterNode* newNode = slab_alloc(outer_nodes);
     if (!newNode) {
         perror("Failed to allocate memory for outer node");
         exit(EXIT_FAILURE);
     }
-    newNode->key = strdup(key);
-    if (!newNode->key) {
-        perror("Failed to allocate memory for key");
-        free(newNode);
-        exit(EXIT_FAILURE);
-    }
+    strncpy(newNode->key, key, MAX_STRING_SIZE - 1);
+    newNode->key[MAX_STRING_SIZE - 1] = '\0';
     newNode->innerList = NULL;
     newNode->next = NULL;
     return newNode;
@@ -84,7 +99,7 @@ void removeFromList(char* key, int notification_pipe) {
                     } else {
                         innerPrev->next = innerCurrent->next;
                     }
-                    free(innerCurrent);
+                    slab_free(innerCurrent);
                     pthread_mutex_unlock(&subscriptions_head.mutex);
                     return;
                 }
@@ -108,14 +123,13 @@ void removeKey(char* key) {
             } else {
                 prev->next = current->next;
             }
-            free(current->key);
             InnerNode* innerCurrent = current->innerList;
             while (innerCurrent != NULL) {
                 InnerNode* temp = innerCurrent;
                 innerCurrent = innerCurrent->next;
-                free(temp);
+                slab_free(temp);
             }
-            free(current);
+            slab_free(current);
             pthread_mutex_unlock(&subscriptions_head.mutex);
             return;
         }
@@ -130,7 +144,13 @@ InnerNode* copyInnerList(InnerNode* head) {
     InnerNode* current = head;
     InnerNode* prev = NULL;
     while (current != NULL) {
-        InnerNode* newNode = createInnerNode(current->notification_pipe);
+        InnerNode* newNode = slab_alloc(inner_copies);
+        if (!newNode) {
+            perror("Failed to allocate memory for inner node");
+            exit(EXIT_FAILURE);
+        }
+        newNode->notification_pipe = current->notification_pipe;
+        newNode->next = NULL;
         if (prev == NULL) {
             newHead = newNode;
         } else {
@@ -163,25 +183,17 @@ void freeInnerList(InnerNode* head) {
     while (current != NULL) {
         InnerNode* temp = current;
         current = current->next;
-        free(temp);
+        slab_free(temp);
     }
 }
 
 void cleanupSubscriptions() {
     pthread_mutex_lock(&subscriptions_head.mutex);
-    OuterNode* current = subscriptions_head.node;
-    while (current != NULL) {
-        InnerNode* innerCurrent = current->innerList;
-        while (innerCurrent != NULL) {
-            InnerNode* temp = innerCurrent;
-            innerCurrent = innerCurrent->next;
-            free(temp);
-        }
-        OuterNode* temp = current;
-        current = current->next;
-        free(temp->key);
-        free(temp);
-    }
     subscriptions_head.node = NULL;
+    // nothing else holds subscription nodes, so their slabs go away whole
+    if (inner_nodes != NULL) {
+        slab_release_all(inner_nodes);
+        slab_release_all(outer_nodes);
+    }
     pthread_mutex_unlock(&subscriptions_head.mutex);
 }
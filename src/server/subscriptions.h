@@ -11,7 +11,7 @@ typedef struct InnerNode {
 
 // linked list of keys
 typedef struct OuterNode {
-    char* key;
+    char key[MAX_STRING_SIZE];
     InnerNode* innerList;
     struct OuterNode* next;
 } OuterNode;
@@ -34,6 +34,7 @@ InnerNode* findKey(char* key);
 
 void freeInnerList(InnerNode* head);
 
+// Drops every subscription at once, releasing the nodes' slabs.
 void cleanupSubscriptions();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include "throttle.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "io.h"
+
+#define BURST_MS 100       // the bucket holds this much of the rate
+#define ADJUST_MS 100      // the adaptive mode revises the rate this often
+#define MIN_RATE_SHARE 16  // it never goes below the limit over this, and
+                           // climbs back by as much at a time
+#define SLOW_FACTOR 2      // batches this many times slower than usual back off
+
+static struct {
+  pthread_mutex_t lock;
+  uint64_t limit;          // bytes per second, 0 for no limit
+  int adaptive;
+  uint64_t rate;           // current rate, the limit unless backing off
+  int64_t tokens;          // bytes, negative while writers wait for them
+  uint64_t last_refill;
+  uint64_t last_adjust;
+  uint64_t usual_ns;       // latency of writes when backups do not get in the way
+  uint64_t bytes;
+  unsigned long waits;
+  uint64_t waited_ns;
+  unsigned long back_offs;
+} throttle = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Moving average of the latency of WRITE and DELETE batches, updated
+// without the lock: a lost update only skews it a little.
+static atomic_uint_fast64_t recent_ns = 0;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void throttle_init(uint64_t bytes_per_sec, int adaptive) {
+  pthread_mutex_lock(&throttle.lock);
+  throttle.limit = bytes_per_sec;
+  throttle.adaptive = adaptive && bytes_per_sec > 0;
+  throttle.rate = bytes_per_sec;
+  throttle.tokens = (int64_t)(bytes_per_sec * BURST_MS / 1000);
+  throttle.last_refill = now_ns();
+  throttle.last_adjust = throttle.last_refill;
+  pthread_mutex_unlock(&throttle.lock);
+}
+
+// Halves the rate while writes are slow, raises it back otherwise. Called
+// with the lock held, only while backups write.
+static void adjust_rate(uint64_t now) {
+  throttle.last_adjust = now;
+  uint64_t recent = atomic_load_explicit(&recent_ns, memory_order_relaxed);
+  if (recent == 0) {
+    return; // no write yet
+  }
+  // the usual latency follows drops right away and rises slowly, so a long
+  // backup does not make its own slowdown the usual
+  if (throttle.usual_ns == 0 || recent < throttle.usual_ns) {
+    throttle.usual_ns = recent;
+  } else {
+    throttle.usual_ns += (recent - throttle.usual_ns) / 64;
+  }
+
+  uint64_t step = throttle.limit / MIN_RATE_SHARE;
+  if (recent > throttle.usual_ns * SLOW_FACTOR) {
+    throttle.rate = throttle.rate / 2 < step ? step : throttle.rate / 2;
+    throttle.back_offs++;
+  } else {
+    throttle.rate = throttle.rate + step > throttle.limit ? throttle.limit : throttle.rate + step;
+  }
+}
+
+void throttle_acquire(size_t bytes) {
+  if (throttle.limit == 0) {
+    return; // set before the backups start
+  }
+
+  pthread_mutex_lock(&throttle.lock);
+  uint64_t now = now_ns();
+  if (throttle.adaptive && now - throttle.last_adjust >= (uint64_t)ADJUST_MS * 1000000) {
+    adjust_rate(now);
+  }
+  uint64_t elapsed = now - throttle.last_refill;
+  if (elapsed > 1000000000) {
+    elapsed = 1000000000; // more than the bucket holds anyway
+  }
+  int64_t burst = (int64_t)(throttle.rate * BURST_MS / 1000);
+  // milliseconds and the rest apart: elapsed * rate overflows from about
+  // 18ms at the top rate
+  uint64_t refill = elapsed / 1000000 * throttle.rate / 1000 +
+                    elapsed % 1000000 * throttle.rate / 1000000000;
+  throttle.tokens += (int64_t)refill;
+  if (throttle.tokens > burst) {
+    throttle.tokens = burst;
+  }
+  throttle.last_refill = now;
+
+  // the bytes are taken right away, whoever comes next waits for them too
+  throttle.tokens -= (int64_t)bytes;
+  throttle.bytes += bytes;
+  uint64_t wait_ns = 0;
+  if (throttle.tokens < 0) {
+    wait_ns = (uint64_t)(-throttle.tokens) * 1000000000 / throttle.rate;
+    throttle.waits++;
+    throttle.waited_ns += wait_ns;
+  }
+  pthread_mutex_unlock(&throttle.lock);
+
+  if (wait_ns > 0) {
+    struct timespec delay = {(time_t)(wait_ns / 1000000000), (long)(wait_ns % 1000000000)};
+    nanosleep(&delay, NULL);
+  }
+}
+
+uint64_t throttle_begin_write() {
+  return throttle.adaptive ? now_ns() : 0;
+}
+
+void throttle_end_write(uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t latency = now_ns() - start;
+  uint64_t recent = atomic_load_explicit(&recent_ns, memory_order_relaxed);
+  recent = recent == 0 ? latency : recent - recent / 8 + latency / 8;
+  atomic_store_explicit(&recent_ns, recent, memory_order_relaxed);
+}
+
+void throttle_report(int fd) {
+  pthread_mutex_lock(&throttle.lock);
+  uint64_t limit = throttle.limit;
+  uint64_t rate = throttle.rate;
+  uint64_t bytes = throttle.bytes;
+  unsigned long waits = throttle.waits;
+  uint64_t waited_ns = throttle.waited_ns;
+  unsigned long back_offs = throttle.back_offs;
+  pthread_mutex_unlock(&throttle.lock);
+  if (limit == 0) {
+    return;
+  }
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "Backup throttle: limit %lu B/s, now %lu B/s, %lu bytes, %lu waits, "
+           "%lu ms throttled, %lu back offs\n",
+           (unsigned long)limit, (unsigned long)rate, (unsigned long)bytes, waits,
+           (unsigned long)(waited_ns / 1000000), back_offs);
+  write_str(fd, line);
+}
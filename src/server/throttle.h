@@ -0,0 +1,37 @@
+#ifndef KVS_THROTTLE_H
+#define KVS_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Token bucket shared by everything that writes backups: job BACKUPs, their
+// segments and checkpoints. Writers take tokens for the bytes they are about
+// to write and sleep once the bucket is empty, so backups together stay
+// under a set rate and leave the disk to the jobs' output and the log.
+// In adaptive mode the rate is halved whenever WRITE and DELETE batches get
+// much slower than usual while backups run, and climbs back once they
+// recover.
+
+/// Sets the rate limit, before any backup starts.
+/// @param bytes_per_sec Rate of every backup together, 0 for no limit.
+/// @param adaptive Non zero to back off when foreground writes slow down.
+void throttle_init(uint64_t bytes_per_sec, int adaptive);
+
+/// Takes tokens for bytes about to be written, sleeping until there are
+/// enough. Writers that come meanwhile wait behind it.
+/// @param bytes Bytes about to be written.
+void throttle_acquire(size_t bytes);
+
+/// Starts timing a WRITE or DELETE batch, for the adaptive mode.
+/// @return Start of the batch, 0 when latencies are not needed.
+uint64_t throttle_begin_write();
+
+/// Records how long a WRITE or DELETE batch took.
+/// @param start Value returned by throttle_begin_write.
+void throttle_end_write(uint64_t start);
+
+/// Writes the throttling statistics, if backups are throttled.
+/// @param fd File descriptor to write to.
+void throttle_report(int fd);
+
+#endif  // KVS_THROTTLE_H
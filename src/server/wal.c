@@ -0,0 +1,301 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "encode.h"
+#include "src/common/io.h"
+
+#define RECORD_HEADER_SIZE 8
+// operation, key count, and both strings with their lengths for every key
+#define MAX_RECORD_SIZE (RECORD_HEADER_SIZE + 3 + MAX_WRITE_SIZE * 2 * MAX_STRING_SIZE)
+
+typedef struct {
+  unsigned char *data;
+  size_t used;
+  size_t capacity;
+} LogBuffer;
+
+// Appends go to pending. The thread that syncs swaps it with writing, and
+// writes it out without the lock while the others keep appending.
+static struct {
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // a sync finished, or enough became pending
+  LogBuffer pending;
+  LogBuffer writing;
+  uint64_t appended;      // position of the end of pending
+  uint64_t durable;       // everything before it is on disk
+  int syncing;            // a thread is writing
+  int failed;
+  unsigned int delay_ms;
+  size_t flush_bytes;
+} wal = {-1, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+         {NULL, 0, 0}, {NULL, 0, 0}, 0, 0, 0, 0, 0, 0};
+
+// Set before the job threads start and cleared after they stop.
+static int enabled = 0;
+
+static int buffer_append(LogBuffer *buffer, const unsigned char *data, size_t len) {
+  if (buffer->used + len > buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 65536 : buffer->capacity;
+    while (capacity < buffer->used + len) {
+      capacity *= 2;
+    }
+    unsigned char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      return 1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->used, data, len);
+  buffer->used += len;
+  return 0;
+}
+
+static size_t put_string(unsigned char *p, const char *str) {
+  size_t len = strnlen(str, MAX_STRING_SIZE - 1);
+  p[0] = (unsigned char)len;
+  memcpy(p + 1, str, len);
+  return len + 1;
+}
+
+// Reads a length prefixed string of a payload.
+// @return Bytes read, 0 if the payload is malformed.
+static size_t get_string(const unsigned char *p, size_t left, char *str) {
+  if (left < 1 || p[0] >= MAX_STRING_SIZE || left - 1 < p[0]) {
+    return 0;
+  }
+  memcpy(str, p + 1, p[0]);
+  str[p[0]] = '\0';
+  return (size_t)p[0] + 1;
+}
+
+// Decodes a payload and applies it.
+// @return 0 on success, 1 if the payload is malformed.
+static int replay_record(const unsigned char *p, size_t len, wal_apply_fn apply, void *arg) {
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  if (len < 3 || p[0] > WAL_DELETE) {
+    return 1;
+  }
+  WalOp op = p[0] == WAL_DELETE ? WAL_DELETE : WAL_WRITE;
+  size_t num_pairs = get_u16(p + 1);
+  if (num_pairs == 0 || num_pairs > MAX_WRITE_SIZE) {
+    return 1;
+  }
+
+  size_t offset = 3;
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t read = get_string(p + offset, len - offset, keys[i]);
+    if (read == 0) {
+      return 1;
+    }
+    offset += read;
+    if (op == WAL_WRITE) {
+      read = get_string(p + offset, len - offset, values[i]);
+      if (read == 0) {
+        return 1;
+      }
+      offset += read;
+    }
+  }
+  if (offset != len) {
+    return 1;
+  }
+  apply(op, num_pairs, keys, op == WAL_WRITE ? values : NULL, arg);
+  return 0;
+}
+
+int wal_replay(const char *path, wal_apply_fn apply, void *arg) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "Failed to open log %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to read log %s\n", path);
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map log %s\n", path);
+    close(fd);
+    return 1;
+  }
+
+  size_t offset = 0;
+  while (size - offset >= RECORD_HEADER_SIZE) {
+    uint32_t len = get_u32(data + offset);
+    uint32_t checksum = get_u32(data + offset + 4);
+    const unsigned char *payload = data + offset + RECORD_HEADER_SIZE;
+    if (len > size - offset - RECORD_HEADER_SIZE ||
+        (uint32_t)fnv1a(FNV_OFFSET, payload, len) != checksum ||
+        replay_record(payload, len, apply, arg) != 0) {
+      break;
+    }
+    offset += RECORD_HEADER_SIZE + len;
+  }
+  munmap((void *)data, size);
+
+  int failed = 0;
+  if (offset < size) {
+    // only a crash during an append can leave this, the batch was never acknowledged
+    fprintf(stderr, "Discarding %zu bytes at the end of log %s\n", size - offset, path);
+    failed = ftruncate(fd, (off_t)offset) != 0;
+  }
+  close(fd);
+  return failed;
+}
+
+int wal_open(const char *path, unsigned int delay_ms, size_t flush_bytes) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open log %s\n", path);
+    return 1;
+  }
+  off_t end = lseek(fd, 0, SEEK_END);
+  if (end < 0) {
+    close(fd);
+    return 1;
+  }
+
+  pthread_mutex_lock(&wal.lock);
+  wal.fd = fd;
+  wal.appended = (uint64_t)end;
+  wal.durable = (uint64_t)end;
+  wal.failed = 0;
+  wal.delay_ms = delay_ms;
+  wal.flush_bytes = flush_bytes;
+  pthread_mutex_unlock(&wal.lock);
+  enabled = 1;
+  return 0;
+}
+
+uint64_t wal_log(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                 char values[][MAX_STRING_SIZE]) {
+  if (!enabled) {
+    return 0;
+  }
+
+  // encoded before taking the lock, only the copy is serialized
+  unsigned char record[MAX_RECORD_SIZE];
+  unsigned char *payload = record + RECORD_HEADER_SIZE;
+  payload[0] = (unsigned char)op;
+  put_u16(payload + 1, (uint16_t)num_pairs);
+  size_t len = 3;
+  for (size_t i = 0; i < num_pairs; i++) {
+    len += put_string(payload + len, keys[i]);
+    if (op == WAL_WRITE) {
+      len += put_string(payload + len, values[i]);
+    }
+  }
+  put_u32(record, (uint32_t)len);
+  put_u32(record + 4, (uint32_t)fnv1a(FNV_OFFSET, payload, len));
+
+  pthread_mutex_lock(&wal.lock);
+  if (buffer_append(&wal.pending, record, RECORD_HEADER_SIZE + len) != 0) {
+    fprintf(stderr, "Failed to append to the log\n");
+    wal.failed = 1;
+  }
+  wal.appended += RECORD_HEADER_SIZE + len;
+  uint64_t lsn = wal.appended;
+  if (wal.syncing && wal.pending.used >= wal.flush_bytes) {
+    pthread_cond_broadcast(&wal.changed);
+  }
+  pthread_mutex_unlock(&wal.lock);
+  return lsn;
+}
+
+// Gives the batches appended meanwhile a chance to join the next write.
+static void wait_for_more() {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += (long)(wal.delay_ms % 1000) * 1000000;
+  deadline.tv_sec += wal.delay_ms / 1000 + deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (wal.pending.used < wal.flush_bytes &&
+         pthread_cond_timedwait(&wal.changed, &wal.lock, &deadline) == 0)
+    ;
+}
+
+int wal_sync(uint64_t lsn) {
+  if (!enabled || lsn == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wal.lock);
+  while (wal.durable < lsn && !wal.failed) {
+    if (wal.syncing) {
+      pthread_cond_wait(&wal.changed, &wal.lock);
+      continue;
+    }
+
+    // this thread writes and syncs for every batch pending
+    wal.syncing = 1;
+    if (wal.delay_ms > 0) {
+      wait_for_more();
+    }
+    LogBuffer writing = wal.pending;
+    wal.pending = wal.writing; // the spare buffer, empty
+    wal.writing = (LogBuffer){NULL, 0, 0};
+    uint64_t end = wal.appended;
+    pthread_mutex_unlock(&wal.lock);
+
+    int ok = write_all(wal.fd, writing.data, writing.used) == 1 && fdatasync(wal.fd) == 0;
+
+    pthread_mutex_lock(&wal.lock);
+    writing.used = 0;
+    wal.writing = writing;
+    if (ok) {
+      wal.durable = end;
+    } else {
+      fprintf(stderr, "Failed to write the log\n");
+      wal.failed = 1;
+    }
+    wal.syncing = 0;
+    pthread_cond_broadcast(&wal.changed);
+  }
+  int failed = wal.failed;
+  pthread_mutex_unlock(&wal.lock);
+  return failed;
+}
+
+void wal_close() {
+  if (!enabled) {
+    return;
+  }
+  pthread_mutex_lock(&wal.lock);
+  uint64_t lsn = wal.appended;
+  pthread_mutex_unlock(&wal.lock);
+  wal_sync(lsn);
+  enabled = 0;
+
+  pthread_mutex_lock(&wal.lock);
+  close(wal.fd);
+  wal.fd = -1;
+  free(wal.pending.data);
+  free(wal.writing.data);
+  wal.pending = (LogBuffer){NULL, 0, 0};
+  wal.writing = (LogBuffer){NULL, 0, 0};
+  pthread_mutex_unlock(&wal.lock);
+}
@@ -0,0 +1,64 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Write-ahead log: every WRITE and DELETE batch is appended, in the order
+// the batches commit, before its thread is told it is done. Appends of
+// concurrent batches are made durable together: the first thread to wait
+// writes and syncs everything pending, the others wait for it.
+//
+// Record: u32 payload length, u32 checksum (low half of the FNV-1a of the
+// payload), payload. Payload: u8 operation, u16 number of keys, then per
+// key u8 length and the key, and for a WRITE u8 length and the value.
+
+typedef enum { WAL_WRITE, WAL_DELETE } WalOp;
+
+/// Called by wal_replay for every batch in the log.
+/// @param op Operation of the batch.
+/// @param num_pairs Number of keys.
+/// @param keys Keys of the batch.
+/// @param values Values of a WRITE, NULL for a DELETE.
+/// @param arg Argument given to wal_replay.
+typedef void (*wal_apply_fn)(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                             char values[][MAX_STRING_SIZE], void *arg);
+
+/// Replays a log, stopping at its first incomplete or corrupted record, which
+/// a crash in the middle of an append leaves behind, and cutting it off.
+/// A missing log is empty.
+/// @param path Path of the log.
+/// @param apply Applies each batch.
+/// @param arg Argument passed to apply.
+/// @return 0 on success, 1 if the log could not be read.
+int wal_replay(const char *path, wal_apply_fn apply, void *arg);
+
+/// Opens the log for appending, which enables wal_log.
+/// @param path Path of the log, created if missing.
+/// @param delay_ms How long the thread that syncs waits for more batches to
+///                 join, 0 to sync right away.
+/// @param flush_bytes Pending bytes after which it syncs without waiting.
+/// @return 0 on success, 1 otherwise.
+int wal_open(const char *path, unsigned int delay_ms, size_t flush_bytes);
+
+/// Appends a batch. Must be called while the batch's shards are write
+/// locked, so conflicting batches are logged in the order they commit.
+/// @param op Operation of the batch.
+/// @param num_pairs Number of keys.
+/// @param keys Keys of the batch.
+/// @param values Values of a WRITE, NULL for a DELETE.
+/// @return Position to give to wal_sync, 0 when the log is not open.
+uint64_t wal_log(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                 char values[][MAX_STRING_SIZE]);
+
+/// Waits until everything logged up to a position is on disk.
+/// @param lsn Position returned by wal_log.
+/// @return 0 on success, 1 if the log could not be written.
+int wal_sync(uint64_t lsn);
+
+/// Syncs what is pending and closes the log.
+void wal_close();
+
+#endif  // KVS_WAL_H